@@ -0,0 +1,94 @@
+#!/bin/sh
+# Check shuffle against a reference and time it on generated inputs of each
+# shape.
+#
+# Usage: bench.sh [bytes] [directory]
+# Inputs of the given size (64 MB by default) are made with gen in the
+# directory (/tmp by default). Each run is compared with the output of awk or
+# sort, and its throughput in MB/s and lines/s and its peak RSS are reported.
+# A random order is checked to be a permutation of the input.
+
+bytes=${1:-67108864}
+dir=${2:-/tmp}
+
+cd "$(dirname "$0")" || exit 1
+make -s shuffle gen || exit 1
+failed=0
+
+# The reference: the lines in the order of -p, read whole by awk or sort.
+# Both also end a last line without a newline with one. For a random order
+# it is the sorted input, to compare with the sorted output.
+reference() {
+	case "$1" in
+	random*) LC_ALL=C sort "$2" ;;
+	sort) LC_ALL=C sort -s "$2" ;;
+	sort:*) LC_ALL=C sort -s -b -k "${1#sort:},${1#sort:}" "$2" ;;
+	reverse) awk '{ a[NR] = $0 } END { for (i = NR; i >= 1; i--) print a[i] }' "$2" ;;
+	stride:*) awk -v k="${1#stride:}" '{ a[NR] = $0 } END {
+		for (j = 1; j <= k; j++) for (i = j; i <= NR; i += k) print a[i] }' "$2" ;;
+	*) awk '{ a[NR] = $0 } END {
+		for (l = 1; l <= NR - l + 1; l++) { print a[l]; if (l != NR - l + 1) print a[NR - l + 1] } }' "$2" ;;
+	esac
+}
+
+run() {
+	order=$1
+	shift
+	case "$*" in
+	*"-i -"*)
+		./shuffle -v -p "$order" "$@" < "$input" > "$output" 2> "$stats"
+		status=$?
+		;;
+	pipe)
+		# Written to a pipe rather than a file.
+		status=$({ { ./shuffle -v -p "$order" -i "$input" -o - 2> "$stats"
+			echo $? >&3; } | cat > "$output"; } 3>&1)
+		;;
+	*)
+		./shuffle -v -p "$order" "$@" -i "$input" -o "$output" 2> "$stats"
+		status=$?
+		;;
+	esac
+	case "$order" in
+	random*) LC_ALL=C sort "$output" > "$sorted" && mv "$sorted" "$output" ;;
+	esac
+	if [ "$status" -ne 0 ] || ! cmp -s "$output" "$expected"; then
+		result=FAIL
+		failed=1
+	else
+		result=ok
+	fi
+	sed -n 's/^stats: //p' "$stats" | awk -v shape="$shape" -v order="$order" -v mode="$*" \
+		-v result=$result '{
+		for (i = 1; i <= NF; i++) { split($i, kv, "="); s[kv[1]] = kv[2] }
+		printf "%-16s %-10s %-14s %-4s %9s MB/s %12s lines/s %10s\n", shape, order,
+			mode, result, s["MB/s"], s["lines/s"], s["max_rss"]
+	}'
+	[ $result = ok ] || echo "$shape $order $*: FAIL (exit $status)"
+}
+
+input=$dir/shuffle_input
+output=$dir/shuffle_output
+expected=$dir/shuffle_expected
+stats=$dir/shuffle_stats
+sorted=$dir/shuffle_sorted
+for shape in tiny "tiny -N" empty huge exponential "exponential -N"; do
+	# shellcheck disable=SC2086
+	./gen -s $shape -b "$bytes" "$input" > /dev/null || exit 1
+	for order in interleave reverse stride:3 random:7 sort sort:2; do
+		reference "$order" "$input" > "$expected"
+		run "$order"
+		run "$order" -t 4
+		run "$order" -B 8
+		run "$order" -i - -o -
+		run "$order" pipe
+		if [ "$order" = interleave ]; then
+			run "$order" -m 64
+			# Windows of a third of a megabyte, so that even a small input
+			# spans several.
+			run "$order" -m 1
+		fi
+	done
+done
+rm -f "$input" "$output" "$expected" "$stats" "$sorted"
+exit $failed
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+// Shapes of the inputs made.
+enum shape {
+	TINY,                 /* Lines of 0 to 7 characters. */
+	EMPTY,                /* Empty lines only. */
+	HUGE,                 /* One line of the whole size. */
+	EXPONENTIAL           /* Lengths exponentially distributed around the mean. */
+};
+
+uint64_t seed = 1;                 /* State of the random number generator. */
+
+void usage(void) {
+	fprintf(stderr, "Usage: gen [-s tiny|empty|huge|exponential] [-b bytes] [-m mean] "
+		"[-S seed] [-N] outputfile\n");
+	exit(1);
+}
+
+/**
+ * Return a pseudo-random number (xorshift64*).
+ */
+uint64_t next_random() {
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Return the length of the next line, not counting its newline.
+ */
+size_t line_length(enum shape shape, size_t left, size_t mean) {
+	switch (shape) {
+	case TINY:
+		return next_random() % 8;
+	case EMPTY:
+		return 0;
+	case HUGE:
+		return left - 1;
+	default: {
+		// Uniform in (0, 1].
+		double u = (double)((next_random() >> 11) + 1) / (double)(1ULL << 53);
+		return (size_t)(-log(u) * mean);
+	}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	enum shape shape = EXPONENTIAL;
+	size_t bytes = 64 << 20;
+	size_t mean = 80;
+	int newline = 1;
+	int c;
+	opterr = 0;
+	while ((c = getopt(argc, argv, "s:b:m:S:N")) != -1) {
+		switch (c) {
+		case 's':
+			if (strcmp(optarg, "tiny") == 0) {
+				shape = TINY;
+			}
+			else if (strcmp(optarg, "empty") == 0) {
+				shape = EMPTY;
+			}
+			else if (strcmp(optarg, "huge") == 0) {
+				shape = HUGE;
+			}
+			else if (strcmp(optarg, "exponential") == 0) {
+				shape = EXPONENTIAL;
+			}
+			else {
+				usage();
+			}
+			break;
+		case 'b':
+			bytes = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			mean = strtoull(optarg, NULL, 10);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 10);
+			// xorshift never leaves 0.
+			if (seed == 0) {
+				seed = 1;
+			}
+			break;
+		case 'N':
+			// The last line has no newline.
+			newline = 0;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+	}
+	FILE* fp = fopen(argv[optind], "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Cannot open file %s\n", argv[optind]);
+		exit(1);
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+	// Lines are numbered so that a lost or repeated line shows.
+	char line[64];
+	size_t written = 0;
+	uint64_t nums = 0;
+	while (written < bytes) {
+		size_t length = line_length(shape, bytes - written, mean);
+		// A last line without a newline takes its byte, so it is never empty.
+		if (length >= bytes - written - 1) {
+			length = bytes - written - 1 + !newline;
+		}
+		for (size_t done = 0; done < length;) {
+			int n = done == 0 && length >= 21 ? snprintf(line, sizeof(line), "%020llu ",
+				(unsigned long long)nums) : 0;
+			if (n == 0) {
+				size_t k = length - done < sizeof(line) ? length - done : sizeof(line);
+				memset(line, 'a' + nums % 26, k);
+				n = k;
+			}
+			fwrite(line, 1, n, fp);
+			done += n;
+		}
+		written += length + 1;
+		nums++;
+		if (written < bytes || newline) {
+			fputc('\n', fp);
+		}
+	}
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "fclose() failed\n");
+		exit(1);
+	}
+	printf("%llu lines, %zu bytes\n", (unsigned long long)nums, written - !newline);
+	return 0;
+}
@@ -1,23 +1,750 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
 
+// Alignment of buffers and writes for O_DIRECT.
+#define ALIGN 4096
+
+// Bytes an input that cannot be mapped is first read into.
+#define CHUNK (16 << 20)
+
+// Lines gathered for the output file. Lines are written in place from the
+// input with writev(), or copied into a buffer that is written whole when
+// large writes are asked for.
+struct writer {
+	int fd;               /* Output file. */
+	off_t offset;         /* Where the next write goes, -1 for the file position. */
+	struct iovec* iov;    /* Lines not written yet. */
+	int niov;             /* Number of entries in iov. */
+	int max_iov;          /* Lines written by one writev(). */
+	char* buf;            /* Buffer for large writes, NULL to write in place. */
+	size_t used;          /* Bytes in buf. */
+	size_t capacity;      /* Size of buf, a multiple of ALIGN. */
+	int direct;           /* fd was opened with O_DIRECT. */
+	int splice;           /* fd is a pipe the lines are spliced into. */
+};
+
+// Orders of the output lines.
+enum order {
+	INTERLEAVE,           /* First, last, second, second to last... */
+	REVERSE,              /* Last to first. */
+	STRIDE,               /* Every k-th line from the first, then from the second... */
+	RANDOM,               /* A random permutation. */
+	SORT                  /* Sorted by key. */
+};
+
+// The share of one thread: a range of bytes of the input while indexing, a
+// range of output lines while writing.
+struct task {
+	size_t begin;         /* First byte or output line. */
+	size_t end;           /* Just past the last one. */
+	size_t nums;          /* Lines ending in the range of bytes. */
+	size_t first;         /* Index of the first of them. */
+	off_t offset;         /* Where the range of output lines goes. */
+	pthread_t thread;
+};
+
+// A block of the input read with pread(), for the bounded-memory mode.
+struct window {
+	char* buf;            /* The bytes read. */
+	size_t size;          /* Size of buf, a multiple of ALIGN. */
+	off_t start;          /* Offset of buf in the input, a multiple of size. */
+	size_t length;        /* Bytes of buf read, less than size at the end. */
+};
+
+char* data;                        /* The input file, mapped. */
+size_t fsize;                      /* Size of the input in bytes. */
+size_t mapped;                     /* Bytes mapped at data. */
+size_t* starts;                    /* Offset of each line, then the end of the last. */
+size_t nums;                       /* Number of lines. */
+int missing_newline = 0;           /* The last line has no newline. */
+int out_fd;                        /* Output file. */
+int out_seekable;                  /* The output is a regular file. */
+int out_pipe;                      /* The output is a pipe. */
+int batch = IOV_MAX;               /* Lines per writev(). */
+size_t buffer_size = 0;            /* Size of the buffer for large writes, 0 for none. */
+int direct = 0;                    /* The output is written with O_DIRECT. */
+int threads = 1;                   /* Threads indexing and writing. */
+struct task* tasks;                /* Share of each thread. */
+size_t memory = 0;                 /* Bytes of buffers when streaming, 0 to map the input. */
+int in_fd;                         /* Input file. */
+enum order order = INTERLEAVE;     /* Order of the output lines. */
+size_t stride;                     /* k of STRIDE. */
+uint64_t seed = 1;                 /* State of the random number generator for RANDOM. */
+int key = 0;                       /* Field SORT compares, 0 for the whole line. */
+size_t* permutation;               /* Input line of each output line for RANDOM and SORT. */
+int verbose = 0;                   /* Print the throughput on exit. */
+struct timespec start_time;        /* When shuffle started. */
+
 void usage(void) {
-	fprintf(stderr, "Usage: shuffle -i inputfile -o outputfile\n");
+	fprintf(stderr, "Usage: shuffle [-p interleave|reverse|stride:K|random[:SEED]|sort[:FIELD]] "
+		"[-n lines] [-B MB] [-d] [-t threads | -m MB] [-v] -i inputfile|- -o outputfile|-\n");
 	exit(1);
 }
 
+/**
+ * Set the order of the output lines from the argument of -p.
+ */
+void parse_order(const char* arg) {
+	const char* value = strchr(arg, ':');
+	size_t length = value != NULL ? (size_t)(value - arg) : strlen(arg);
+	if (value != NULL) {
+		value++;
+	}
+	if (strncmp(arg, "interleave", length) == 0 && length == 10 && value == NULL) {
+		order = INTERLEAVE;
+	}
+	else if (strncmp(arg, "reverse", length) == 0 && length == 7 && value == NULL) {
+		order = REVERSE;
+	}
+	else if (strncmp(arg, "stride", length) == 0 && length == 6 && value != NULL) {
+		order = STRIDE;
+		stride = strtoull(value, NULL, 10);
+		if (stride == 0) {
+			usage();
+		}
+	}
+	else if (strncmp(arg, "random", length) == 0 && length == 6) {
+		order = RANDOM;
+		if (value != NULL) {
+			seed = strtoull(value, NULL, 10);
+		}
+		// xorshift never leaves 0.
+		if (seed == 0) {
+			seed = 1;
+		}
+	}
+	else if (strncmp(arg, "sort", length) == 0 && length == 4) {
+		order = SORT;
+		if (value != NULL && (key = atoi(value)) < 1) {
+			usage();
+		}
+	}
+	else {
+		usage();
+	}
+}
+
+/**
+ * Find the lines of the input in one pass. Set nums to the number of lines,
+ * with the offset of the start of line i in starts[i] and the offset just
+ * past the last line in starts[nums]. A last line without a newline is not
+ * counted.
+ */
+void index_lines() {
+	size_t capacity = 1024;
+	nums = 0;
+	starts = malloc(sizeof(size_t) * (capacity + 1));
+	starts[0] = 0;
+	const char* end = data + fsize;
+	for (const char* p = data; p < end; p++) {
+		// memchr() scans for the newline a word or a vector at a time.
+		p = memchr(p, '\n', end - p);
+		if (p == NULL) {
+			break;
+		}
+		if (nums == capacity) {
+			capacity *= 2;
+			starts = realloc(starts, sizeof(size_t) * (capacity + 1));
+		}
+		starts[++nums] = p + 1 - data;
+	}
+}
+
+/**
+ * Count the newlines in the bytes of task t.
+ */
+void* count_lines(void* arg) {
+	struct task* t = arg;
+	const char* end = data + t->end;
+	t->nums = 0;
+	for (const char* p = data + t->begin; p < end; p++) {
+		p = memchr(p, '\n', end - p);
+		if (p == NULL) {
+			break;
+		}
+		t->nums++;
+	}
+	return NULL;
+}
+
+/**
+ * Record the starts of the lines after the newlines in the bytes of task t,
+ * from line t->first + 1 on.
+ */
+void* fill_lines(void* arg) {
+	struct task* t = arg;
+	const char* end = data + t->end;
+	size_t* next = starts + t->first + 1;
+	for (const char* p = data + t->begin; p < end; p++) {
+		p = memchr(p, '\n', end - p);
+		if (p == NULL) {
+			break;
+		}
+		*next++ = p + 1 - data;
+	}
+	return NULL;
+}
+
+/**
+ * Run f on each task, in a thread of its own.
+ */
+void run_tasks(void* (*f)(void*)) {
+	for (int i = 0; i < threads; i++) {
+		pthread_create(&tasks[i].thread, NULL, f, &tasks[i]);
+	}
+	for (int i = 0; i < threads; i++) {
+		pthread_join(tasks[i].thread, NULL);
+	}
+}
+
+/**
+ * index_lines() with the input split between the threads: each counts the
+ * newlines of its share, a prefix sum of the counts tells each where its
+ * lines go, and each records them.
+ */
+void index_lines_parallel() {
+	for (int i = 0; i < threads; i++) {
+		tasks[i].begin = fsize / threads * i;
+		tasks[i].end = i == threads - 1 ? fsize : fsize / threads * (i + 1);
+	}
+	run_tasks(count_lines);
+	nums = 0;
+	for (int i = 0; i < threads; i++) {
+		tasks[i].first = nums;
+		nums += tasks[i].nums;
+	}
+	starts = malloc(sizeof(size_t) * (nums + 1));
+	starts[0] = 0;
+	run_tasks(fill_lines);
+}
+
+/**
+ * Count a last line without a newline, which is written with one.
+ */
+void index_last_line() {
+	if (fsize > 0 && data[fsize - 1] != '\n') {
+		starts = realloc(starts, sizeof(size_t) * (nums + 2));
+		starts[++nums] = fsize;
+		missing_newline = 1;
+	}
+}
+
+/**
+ * Read all of the input, which cannot be mapped, into an anonymous mapping
+ * that grows a chunk at a time. mremap() can move it instead of copying.
+ */
+void read_input() {
+	mapped = CHUNK;
+	data = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "mmap() failed\n");
+		exit(1);
+	}
+	fsize = 0;
+	for (;;) {
+		if (fsize == mapped) {
+			data = mremap(data, mapped, mapped * 2, MREMAP_MAYMOVE);
+			if (data == MAP_FAILED) {
+				fprintf(stderr, "mremap() failed\n");
+				exit(1);
+			}
+			mapped *= 2;
+		}
+		ssize_t n = read(in_fd, data + fsize, mapped - fsize);
+		if (n < 0) {
+			fprintf(stderr, "read() failed\n");
+			exit(1);
+		}
+		if (n == 0) {
+			break;
+		}
+		fsize += n;
+	}
+}
+
+/**
+ * Write length bytes of buf for w.
+ */
+void write_all(struct writer* w, const char* buf, size_t length) {
+	while (length > 0) {
+		ssize_t n = w->offset < 0 ? write(w->fd, buf, length) :
+			pwrite(w->fd, buf, length, w->offset);
+		if (n < 0) {
+			fprintf(stderr, "write() failed\n");
+			exit(1);
+		}
+		if (w->offset >= 0) {
+			w->offset += n;
+		}
+		buf += n;
+		length -= n;
+	}
+}
+
+/**
+ * Write the niov buffers of iov for w, picking up after a short write.
+ */
+void writev_all(struct writer* w, struct iovec* iov, int niov) {
+	while (niov > 0) {
+		ssize_t n;
+		if (w->splice) {
+			// The pipe takes references to the pages of the input instead
+			// of a copy, unless it cannot.
+			n = vmsplice(w->fd, iov, niov, 0);
+			if (n < 0) {
+				w->splice = 0;
+				continue;
+			}
+		}
+		else {
+			n = w->offset < 0 ? writev(w->fd, iov, niov) : pwritev(w->fd, iov, niov, w->offset);
+		}
+		if (n < 0) {
+			fprintf(stderr, "writev() failed\n");
+			exit(1);
+		}
+		if (w->offset >= 0) {
+			w->offset += n;
+		}
+		// Skip the buffers written, then the written part of the next one.
+		while (niov > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/**
+ * Start w writing to the output at offset, or at the file position if offset
+ * is -1.
+ */
+void writer_init(struct writer* w, off_t offset) {
+	memset(w, 0, sizeof(*w));
+	w->fd = out_fd;
+	w->offset = offset;
+	w->direct = direct;
+	w->splice = out_pipe && buffer_size == 0;
+	if (buffer_size > 0) {
+		w->capacity = (buffer_size + ALIGN - 1) / ALIGN * ALIGN;
+		if (posix_memalign((void**)&w->buf, ALIGN, w->capacity) != 0) {
+			fprintf(stderr, "posix_memalign() failed\n");
+			exit(1);
+		}
+	}
+	else {
+		w->max_iov = batch;
+		w->iov = malloc(sizeof(struct iovec) * batch);
+	}
+}
+
+/**
+ * Write what w holds so far. With a buffer, only whole buffers are written
+ * before writer_finish(), so O_DIRECT writes stay aligned.
+ */
+void writer_flush(struct writer* w) {
+	if (w->buf != NULL) {
+		write_all(w, w->buf, w->used);
+		w->used = 0;
+	}
+	else {
+		writev_all(w, w->iov, w->niov);
+		w->niov = 0;
+	}
+}
+
+/**
+ * Add the length bytes at p to the output.
+ */
+void writer_add(struct writer* w, const char* p, size_t length) {
+	if (w->buf == NULL) {
+		w->iov[w->niov].iov_base = (void*)p;
+		w->iov[w->niov].iov_len = length;
+		if (++w->niov == w->max_iov) {
+			writer_flush(w);
+		}
+		return;
+	}
+	while (length > 0) {
+		size_t n = w->capacity - w->used < length ? w->capacity - w->used : length;
+		memcpy(w->buf + w->used, p, n);
+		w->used += n;
+		p += n;
+		length -= n;
+		if (w->used == w->capacity) {
+			writer_flush(w);
+		}
+	}
+}
+
+/**
+ * Write the rest of the output and free w. O_DIRECT is turned off for a last
+ * write that is not a multiple of the alignment.
+ */
+void writer_finish(struct writer* w) {
+	if (w->direct && w->used % ALIGN != 0) {
+		fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+	}
+	writer_flush(w);
+	free(w->iov);
+	free(w->buf);
+}
+
+/**
+ * Add line i of the input to the output.
+ */
+void add_line(struct writer* w, size_t i) {
+	writer_add(w, data + starts[i], starts[i + 1] - starts[i]);
+	if (i == nums - 1 && missing_newline) {
+		writer_add(w, "\n", 1);
+	}
+}
+
+/**
+ * Return a pseudo-random number (xorshift64*).
+ */
+uint64_t next_random() {
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Return the key of line i and set *length to its length: the whole line
+ * without its newline, or its key-th field separated by blanks.
+ */
+const char* line_key(size_t i, size_t* length) {
+	const char* p = data + starts[i];
+	const char* end = data + starts[i + 1];
+	// The last line may have no newline.
+	if (end > p && end[-1] == '\n') {
+		end--;
+	}
+	for (int field = 1; key != 0; field++) {
+		while (p < end && (*p == ' ' || *p == '\t')) {
+			p++;
+		}
+		const char* q = p;
+		while (q < end && *q != ' ' && *q != '\t') {
+			q++;
+		}
+		if (field == key) {
+			end = q;
+			break;
+		}
+		p = q;
+	}
+	*length = end - p;
+	return p;
+}
+
+/**
+ * Order lines by key, then by position so that the order is stable.
+ */
+int compare_lines(const void* a, const void* b) {
+	size_t x = *(const size_t*)a;
+	size_t y = *(const size_t*)b;
+	size_t m, n;
+	const char* p = line_key(x, &m);
+	const char* q = line_key(y, &n);
+	int c = memcmp(p, q, m < n ? m : n);
+	if (c != 0) {
+		return c;
+	}
+	if (m != n) {
+		return m < n ? -1 : 1;
+	}
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Build the permutation of the orders that are not computed line by line:
+ * a Fisher-Yates shuffle of the lines, or the lines sorted.
+ */
+void build_permutation() {
+	if (order != RANDOM && order != SORT) {
+		return;
+	}
+	permutation = malloc(sizeof(size_t) * (nums + 1));
+	for (size_t i = 0; i < nums; i++) {
+		permutation[i] = i;
+	}
+	if (order == RANDOM) {
+		for (size_t i = nums; i > 1; i--) {
+			size_t j = next_random() % i;
+			size_t line = permutation[i - 1];
+			permutation[i - 1] = permutation[j];
+			permutation[j] = line;
+		}
+	}
+	else {
+		qsort(permutation, nums, sizeof(size_t), compare_lines);
+	}
+}
+
+/**
+ * Return the input line that is output line k.
+ */
+size_t line_at(size_t k) {
+	switch (order) {
+	case INTERLEAVE:
+		// Line p from the front and line nums - 1 - p from the back make
+		// output lines 2p and 2p + 1.
+		return k % 2 == 0 ? k / 2 : nums - 1 - k / 2;
+	case REVERSE:
+		return nums - 1 - k;
+	case STRIDE: {
+		// The first nums % stride runs have one line more than the others.
+		size_t q = nums / stride, r = nums % stride;
+		if (k < r * (q + 1)) {
+			return k / (q + 1) + k % (q + 1) * stride;
+		}
+		k -= r * (q + 1);
+		return r + k / q + k % q * stride;
+	}
+	default:
+		return permutation[k];
+	}
+}
+
+/**
+ * Add up the lengths of the output lines of task t, which are written after
+ * those of the tasks before it.
+ */
+void* sum_lengths(void* arg) {
+	struct task* t = arg;
+	t->offset = 0;
+	for (size_t k = t->begin; k < t->end; k++) {
+		size_t i = line_at(k);
+		t->offset += starts[i + 1] - starts[i] + (i == nums - 1 && missing_newline);
+	}
+	return NULL;
+}
+
+/**
+ * Write the output lines of task t. A single thread writes at the file
+ * position; several write at the offsets of their ranges.
+ */
+void* write_lines(void* arg) {
+	struct task* t = arg;
+	struct writer w;
+	writer_init(&w, threads > 1 ? t->offset : -1);
+	for (size_t k = t->begin; k < t->end; k++) {
+		add_line(&w, line_at(k));
+	}
+	writer_finish(&w);
+	return NULL;
+}
+
+/**
+ * Allocate a window of size bytes.
+ */
+void window_init(struct window* win, size_t size) {
+	win->size = size;
+	win->start = -1;
+	win->length = 0;
+	if (posix_memalign((void**)&win->buf, ALIGN, size) != 0) {
+		fprintf(stderr, "posix_memalign() failed\n");
+		exit(1);
+	}
+}
+
+/**
+ * Make win hold the byte at offset of the input, reading the aligned block
+ * around it if it does not already.
+ */
+void window_load(struct window* win, off_t offset) {
+	if (offset >= win->start && offset < win->start + (off_t)win->length) {
+		return;
+	}
+	win->start = offset / win->size * win->size;
+	win->length = 0;
+	while (win->length < win->size && win->start + (off_t)win->length < (off_t)fsize) {
+		ssize_t n = pread(in_fd, win->buf + win->length, win->size - win->length,
+			win->start + win->length);
+		if (n <= 0) {
+			fprintf(stderr, "pread() failed\n");
+			exit(1);
+		}
+		win->length += n;
+	}
+}
+
+/**
+ * Return the offset of the last newline of the input from lo up to end, or
+ * -1 if there is none, reading win backwards.
+ */
+off_t last_newline(struct window* win, off_t lo, off_t end) {
+	while (end > lo) {
+		window_load(win, end - 1);
+		off_t from = win->start > lo ? win->start : lo;
+		char* q = memrchr(win->buf + (from - win->start), '\n', end - from);
+		if (q != NULL) {
+			return win->start + (q - win->buf);
+		}
+		end = from;
+	}
+	return -1;
+}
+
+/**
+ * Add the bytes of the input from offset up to end to the output, reading
+ * them through win.
+ */
+void copy_range(struct writer* w, struct window* win, off_t offset, off_t end) {
+	while (offset < end) {
+		window_load(win, offset);
+		off_t stop = win->start + (off_t)win->length < end ? win->start + (off_t)win->length : end;
+		writer_add(w, win->buf + (offset - win->start), stop - offset);
+		offset = stop;
+	}
+}
+
+/**
+ * Shuffle with memory that does not depend on the size of the input: the
+ * head of the input is read forwards and the tail backwards, a window at a
+ * time, and the lines go straight to the output. The lines not written yet
+ * are the bytes from lo up to hi. A line longer than a window is copied a
+ * window at a time.
+ */
+void stream_lines() {
+	struct window front, back;
+	size_t size = memory / 3 / ALIGN * ALIGN;
+	if (size < ALIGN) {
+		size = ALIGN;
+	}
+	window_init(&front, size);
+	window_init(&back, size);
+	posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	struct writer w;
+	writer_init(&w, -1);
+	off_t lo = 0;
+	off_t hi = fsize;
+	// A last line without a newline is written with one.
+	if (fsize > 0) {
+		window_load(&back, fsize - 1);
+		missing_newline = back.buf[fsize - 1 - back.start] != '\n';
+	}
+	while (lo < hi) {
+		// The next line from the front ends at the first newline after lo.
+		off_t end = lo;
+		while (end < hi) {
+			window_load(&front, end);
+			off_t stop = front.start + (off_t)front.length < hi ?
+				front.start + (off_t)front.length : hi;
+			char* q = memchr(front.buf + (end - front.start), '\n', stop - end);
+			if (q != NULL) {
+				end = front.start + (q - front.buf) + 1;
+				break;
+			}
+			end = stop;
+		}
+		copy_range(&w, &front, lo, end);
+		if (end == (off_t)fsize && missing_newline) {
+			writer_add(&w, "\n", 1);
+		}
+		lo = end;
+		nums++;
+		if (lo >= hi) {
+			break;
+		}
+		// The next line from the back starts after the newline before it.
+		off_t start = last_newline(&back, lo, hi - 1) + 1;
+		if (start < lo) {
+			start = lo;
+		}
+		copy_range(&w, &back, start, hi);
+		if (hi == (off_t)fsize && missing_newline) {
+			writer_add(&w, "\n", 1);
+		}
+		hi = start;
+		nums++;
+	}
+	writer_finish(&w);
+	free(front.buf);
+	free(back.buf);
+}
+
+/**
+ * Open and create the output file. O_DIRECT needs large aligned writes, so
+ * it goes with a buffer; file systems without it get plain writes.
+ */
+void open_output(const char* outFile) {
+	if (direct && buffer_size == 0) {
+		buffer_size = 4 << 20;
+	}
+	out_fd = -1;
+	if (strcmp(outFile, "-") == 0) {
+		out_fd = STDOUT_FILENO;
+		direct = 0;
+	}
+	else if (direct) {
+		out_fd = open(outFile, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		direct = out_fd >= 0;
+	}
+	if (out_fd < 0) {
+		out_fd = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (out_fd < 0) {
+		fprintf(stderr, "Error: Cannot open file %s\n", outFile);
+		exit(1);
+	}
+	struct stat st;
+	if (fstat(out_fd, &st) == -1) {
+		fprintf(stderr, "stat() failed\n");
+		exit(1);
+	}
+	out_seekable = S_ISREG(st.st_mode);
+	out_pipe = S_ISFIFO(st.st_mode);
+}
+
+/**
+ * Print the bytes and lines shuffled per second and the peak memory use to
+ * stderr.
+ */
+void print_stats() {
+	if (!verbose) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double seconds = (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+	if (seconds <= 0) {
+		seconds = 1e-9;
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	fprintf(stderr, "stats: bytes=%zu lines=%zu time=%.3fms MB/s=%.1f lines/s=%.0f max_rss=%ldKB\n",
+		fsize, nums, seconds * 1e3, fsize / seconds / 1e6, nums / seconds, usage.ru_maxrss);
+}
+
 int main(int argc, char* argv[]) {
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 	// arguments
 	char* inFile = NULL;
 	char* outFile = NULL;
 	int c;
 	opterr = 0;
-	while ((c = getopt(argc, argv, "i:o:")) != -1) {
+	while ((c = getopt(argc, argv, "i:o:p:n:B:dt:m:v")) != -1) {
 		switch (c) {
 		case 'i':
 			inFile = strdup(optarg);
@@ -25,124 +752,155 @@ int main(int argc, char* argv[]) {
 		case 'o':
 			outFile = strdup(optarg);
 			break;
+		case 'p':
+			parse_order(optarg);
+			break;
+		case 'n':
+			batch = atoi(optarg);
+			if (batch < 1 || batch > IOV_MAX) {
+				usage();
+			}
+			break;
+		case 'B':
+			buffer_size = (size_t)strtoul(optarg, NULL, 10) << 20;
+			if (buffer_size == 0) {
+				usage();
+			}
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				usage();
+			}
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'm':
+			memory = (size_t)strtoul(optarg, NULL, 10) << 20;
+			if (memory == 0) {
+				usage();
+			}
+			break;
 		default:
 			usage();
 		}
 	}
 
-	if (inFile == NULL || outFile == NULL) {
+	// The threads write at offsets that O_DIRECT would need aligned, and
+	// need the whole input mapped. Streaming reads the head and the tail.
+	if (inFile == NULL || outFile == NULL || (threads > 1 && (direct || memory > 0)) ||
+		(memory > 0 && order != INTERLEAVE)) {
 		usage();
 	}
 
-	// Open the file read-only and return a FILE pointer.
-	FILE* fp = fopen(inFile, "r");
-	// fopen return NULL if an error occured.
-	if (fp == NULL) {
+	// Open the file read-only, or read the standard input.
+	int fd = strcmp(inFile, "-") == 0 ? STDIN_FILENO : open(inFile, O_RDONLY);
+	in_fd = fd;
+	// open() returns -1 if an error occured.
+	if (fd < 0) {
 		fprintf(stderr, "Error: Cannot open file %s\n", inFile);
 		exit(1);
 	}
 
 	// Find the size of the file.
 	struct stat st;
-	// Total size, in bytes.
-	off_t fsize;
-	if (stat(inFile, &st) == -1) {
+	if (fstat(fd, &st) == -1) {
 		fprintf(stderr, "stat() failed\n");
 		exit(1);
 	}
+	// Total size, in bytes.
 	fsize = st.st_size;
-
-	// Number of lines.
-	int nums = 0;
-	char ch = '\0';
-	// Find the number of lines in the file.
-	for (int i = 0; i < fsize; i++) {
-		if (fread(&ch, sizeof(char), 1, fp) != 1) {
-			fprintf(stderr, "fread() failed\n");
-			exit(1);
-		}
-		if (ch == '\n') {
-			nums++;
-		}
+	// Pipes and terminals can be neither mapped nor read backwards.
+	int seekable = S_ISREG(st.st_mode);
+	if (memory > 0 && !seekable) {
+		fprintf(stderr, "Error: -m needs an input file\n");
+		exit(1);
 	}
-	// Store the length of each line.
-	int* lengths = malloc(sizeof(int) * nums);
-	// Reset counter for the number of lines.
-	nums = 0;
-	// Sets the file position indicator to the beginning of the file.
-	rewind(fp);
-
-	int length = 0;
-	// Find the length of each line.
-	for (int i = 0; i < fsize; i++) {
-		length++;
-		if (fread(&ch, sizeof(char), 1, fp) != 1) {
-			fprintf(stderr, "fread() failed\n");
-			exit(1);
-		}
-		if (ch == '\n') {
-			// Null-terminated string.
-			length++;
-			lengths[nums++] = length;
-			length = 0;
+
+	// Lines are copied out of windows that are read again, so they go
+	// through the writer's buffer.
+	if (memory > 0) {
+		if (buffer_size == 0) {
+			buffer_size = memory / 3;
 		}
+		open_output(outFile);
+		stream_lines();
+		print_stats();
+		free(inFile);
+		free(outFile);
+		close(fd);
+		close(out_fd);
+		return 0;
 	}
-	// Store each line into a buffer.
-	char** buffer = malloc(sizeof(char*) * nums);
-	rewind(fp);
 
-	// Read each line into the buffer.
-	for (int i = 0; i < nums; i++) {
-		int len = lengths[i];
-		char* token = malloc(len);
-		if (fread(token, len - 1, 1, fp) != 1) {
-			fprintf(stderr, "fread() failed\n");
+	// Map the file instead of reading it; an empty file cannot be mapped.
+	data = NULL;
+	if (!seekable) {
+		read_input();
+	}
+	else if (fsize > 0) {
+		mapped = fsize;
+		data = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "mmap() failed\n");
 			exit(1);
 		}
-		token[len - 1] = '\0';
-		buffer[i] = token;
+		madvise(data, fsize, threads > 1 ? MADV_WILLNEED : MADV_SEQUENTIAL);
+	}
+	tasks = calloc(threads, sizeof(struct task));
+	// Line i is the bytes from starts[i] up to starts[i + 1], newline included.
+	if (threads > 1) {
+		index_lines_parallel();
+	}
+	else {
+		index_lines();
 	}
+	index_last_line();
 
-	// Open and create output file.
-	FILE* fp1 = fopen(outFile, "w");
-	if (fp1 == NULL) {
-		fprintf(stderr, "Error: Cannot open file %s\n", inFile);
-		exit(1);
+	build_permutation();
+
+	open_output(outFile);
+	for (int i = 0; i < threads; i++) {
+		tasks[i].begin = nums / threads * i;
+		tasks[i].end = i == threads - 1 ? nums : nums / threads * (i + 1);
 	}
-	int left = 0;
-	int right = nums - 1;
-	// Alternate printing lines starting at the beginning of the file moving
-	// forward and lines at the end of the file moving backwards.
-	while (left <= right) {
-		if (left != right) {
-			int length1 = strlen(buffer[left]);
-			int length2 = strlen(buffer[right]);
-			if (fwrite(buffer[left], sizeof(char), length1, fp1) != length1) {
-				fprintf(stderr, "fwrite() failed\n");
-				exit(1);
-			}
-			if (fwrite(buffer[right], sizeof(char), length2, fp1) != length2) {
-				fprintf(stderr, "fwrite() failed\n");
-				exit(1);
-			}
+	// Only a file can be written at offsets; a pipe gets the lines in order.
+	if (!out_seekable) {
+		tasks[0].end = nums;
+		threads = 1;
+	}
+	if (threads > 1) {
+		// Each thread writes a region of its own, sized ahead, after the
+		// lines of the threads before it.
+		if (ftruncate(out_fd, starts[nums] + missing_newline) == -1) {
+			fprintf(stderr, "ftruncate() failed\n");
+			exit(1);
 		}
-		else {
-			int length = strlen(buffer[left]);
-			if (fwrite(buffer[left], sizeof(char), length, fp1) != length) {
-				fprintf(stderr, "fwrite() failed\n");
-				exit(1);
-			}
+		run_tasks(sum_lengths);
+		off_t offset = 0;
+		for (int i = 0; i < threads; i++) {
+			off_t length = tasks[i].offset;
+			tasks[i].offset = offset;
+			offset += length;
 		}
-		left++;
-		right--;
+		run_tasks(write_lines);
+	}
+	else {
+		write_lines(&tasks[0]);
 	}
+	print_stats();
 	free(inFile);
 	free(outFile);
-	fclose(fp);
-	fclose(fp1);
-	free(lengths);
-	for (int i = 0; i < nums; i++) {
-		free(buffer[i]);
+	if (data != NULL) {
+		munmap(data, mapped);
 	}
-	free(buffer);
+	close(fd);
+	close(out_fd);
+	free(starts);
+	free(permutation);
+	free(tasks);
 }
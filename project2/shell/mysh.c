@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,53 +9,101 @@
 #include <fcntl.h>
 #include <linux/limits.h>
 #include <signal.h>
+#include <spawn.h>
 #define MAX_SIZE 129
+#define ARENA_SIZE 16384
+#define STAGE_IN 100   /* Where the standard input of a stage is set up */
+#define STAGE_OUT 101  /* Where the standard output of a stage is set up */
 
 int numOfArgs;        /* Number of arguments */
 int numOfCommand = 1; /* Number of commands entered */
-int in = 0;           /* Check if input redirection is needed */
-int out = 0;          /* Check if output redirection is needed */
-int pl = 0;           /* Check if pipeline is needed */
-int b = 0;            /* Background process indicator */
-char* input = NULL;   /* The name of input file */
-char* output = NULL;  /* The name of output file */
-int processes[20];    /* Background processes */
+int processes[20];    /* Process groups of background commands */
+
+extern char** environ;
+
+// One program of a pipeline.
+struct stage {
+	char** argv;      /* Arguments, terminated by a null pointer */
+	char* input;      /* The name of input file, or NULL */
+	char* output;     /* The name of output file, or NULL */
+};
+
+// A command: stages joined by "|", allocated in the arena.
+struct command {
+	struct stage* stages;
+	int numOfStages;
+	int background;   /* Background process indicator */
+};
 
 char error_message[30] = "An error has occurred\n";
 
+char* line_buffer = NULL;  /* The line read, reused for every command */
+size_t line_capacity = 0;  /* Size of line_buffer */
+/* Memory for the current command, given out in order and taken back all at
+   once when the command is done. A command is at most MAX_SIZE characters,
+   so it always fits. */
+char arena[ARENA_SIZE] __attribute__((aligned(16)));
+size_t arena_used = 0;     /* Bytes of the arena given out */
+/* Move STAGE_IN and STAGE_OUT to the standard input and output of a stage.
+   Built once, since glibc allocates for each action added. */
+posix_spawn_file_actions_t stage_actions;
+
+/**
+ * Allocate size bytes for the current command. Return NULL if the arena
+ * is full.
+ */
+void* mysh_alloc(size_t size) {
+	size = (size + 15) & ~(size_t)15;
+	if (size > ARENA_SIZE - arena_used) {
+		return NULL;
+	}
+	void* p = arena + arena_used;
+	arena_used += size;
+	return p;
+}
+
 /**
- * Read the command from the shell. Exit the shell if
+ * Take back everything allocated for the current command.
+ */
+void mysh_reset(void) {
+	arena_used = 0;
+}
+
+/**
+ * Read the command from the shell into the line buffer, which only
+ * grows when a line is longer than any before. Exit the shell if
  * end-of-file condition occurs.
  */
 char* mysh_read_line(void) {
-	char* line = NULL;
-	size_t length = 0;
 	// End-of-file condition.
-	if (getline(&line, &length, stdin) == -1) {
-		free(line);
+	if (getline(&line_buffer, &line_capacity, stdin) == -1) {
+		free(line_buffer);
 		exit(0);
 	}
-	return line;
+	return line_buffer;
 }
 
 /**
- * Split the input from the shell into arguments.
+ * Split the input from the shell into arguments, which are allocated
+ * in the arena. Return NULL if they do not fit.
  */
 char** mysh_parse_line(char* line) {
 	int num = 0;
-	char** arguments = NULL;
+	// Tokens are separated, so there are at most half as many as
+	// characters, plus the null pointer.
+	char** arguments = mysh_alloc(sizeof(char*) * (strlen(line) / 2 + 2));
+	if (arguments == NULL) {
+		return NULL;
+	}
 	// strtok() returns a pointer to a null-terminated string
 	// containing the next token.
 	char* token = strtok(line, " \n\t");
 	while (token != NULL) {
-		num++;
-		arguments = realloc(arguments, sizeof(char*) * num);
-		arguments[num - 1] = token;
+		arguments[num++] = token;
 		token = strtok(NULL, " \n\t");
 	}
 	numOfArgs = num;
 	// The list of arguments is terminated by a null pointer.
-	arguments = realloc(arguments, sizeof(char*) * (num + 1));
 	arguments[num] = NULL;
 	return arguments;
 }
@@ -66,160 +115,86 @@ char** mysh_parse_line(char* line) {
 void mysh_kill(void) {
 	for (int i = 0; i < 20; i++) {
 		if (processes[i] != 0) {
-			kill(processes[i], SIGQUIT);
+			kill(-processes[i], SIGQUIT);
 		}
 	}
 }
 
 /**
- * Check if redirection or pipeline is needed. Return the index
- * of either the rediction sign or the pipeline sign. Return zero
- * if no rediction or pipeline is needed. Return -1 if the command
- * does not have the right format. Return -2 if there is no command
- * before the redirection sign.
+ * Split the arguments into the stages of a pipeline, each with its
+ * redirections, in cmd. The operators in args are replaced by null pointers
+ * so that each stage's arguments are terminated. Return zero on success.
+ * Return -1 if the command does not have the right format. Return -2 if
+ * there is no command before the redirection sign.
  */
-int mysh_redirection(char** args) {
-	for (int i = 0; i < numOfArgs; i++) {
-		if (strcmp(args[i], ">") == 0) {
-			// There is no command before the ">" operator.
-			if (i == 0) {
-				return -2;
-			}
-			// There is no argument after the ">" operator.
-			if (i == numOfArgs - 1) {
-				return -1;
-			}
-			else if (numOfArgs - i - 1 == 1) {
-				// There is only one argument after the ">" operator.
-				in = 0;
-				output = args[i + 1];
-				out = 1;
-				return i;
-			}
-			else if (numOfArgs - i - 1 == 2) {
-				if (strcmp(args[numOfArgs - 1], "&") == 0) {
-					b = 1;
-					in = 0;
-					output = args[i + 1];
-					out = 1;
-					return i;
-				}
-				else {
-					return -1;
-				}
-			}
-			else if (numOfArgs - i - 1 == 3) {
-				if (strcmp(args[i + 2], "<") == 0) {
-					// Both input redirection and output redirection
-					// is needed.
-					in = 1;
-					input = args[i + 3];
-					out = 1;
-					output = args[i + 1];
-					return i;
-				}
-				else {
-					return -1;
-				}
-			}
-			else if (numOfArgs - i - 1 == 4) {
-				if (strcmp(args[i + 2], "<") == 0) {
-					if (strcmp(args[numOfArgs - 1], "&") == 0) {
-						b = 1;
-						in = 1;
-						input = args[i + 3];
-						out = 1;
-						output = args[i + 1];
-						return i;
-					}
-					else {
-						return -1;
-					}
-				}
-				else {
-					return -1;
-				}
-			}
-			else {
+int mysh_redirection(char** args, struct command* cmd) {
+	int n = numOfArgs;
+	cmd->background = 0;
+	if (strcmp(args[n - 1], "&") == 0) {
+		cmd->background = 1;
+		args[--n] = NULL;
+	}
+	if (n == 0) {
+		return -1;
+	}
+	if (strcmp(args[0], "<") == 0 || strcmp(args[0], ">") == 0) {
+		return -2;
+	}
+	// Each stage has a program and an operator after it but the last.
+	cmd->stages = mysh_alloc(sizeof(struct stage) * (n / 2 + 1));
+	if (cmd->stages == NULL) {
+		return -1;
+	}
+	cmd->numOfStages = 0;
+	struct stage* s = NULL;
+	int redirected = 0;
+	for (int i = 0; i < n; i++) {
+		int op = strcmp(args[i], "|") == 0 || strcmp(args[i], "<") == 0 ||
+			strcmp(args[i], ">") == 0;
+		if (s == NULL) {
+			// There is no program before the operator.
+			if (op) {
 				return -1;
 			}
+			s = &cmd->stages[cmd->numOfStages++];
+			s->argv = &args[i];
+			s->input = NULL;
+			s->output = NULL;
+			redirected = 0;
 		}
-		else if (strcmp(args[i], "<") == 0) {
-			if (i == 0) {
-				return -2;
-			}
-			if (i == numOfArgs - 1) {
+		else if (op) {
+			// There is no argument after the operator.
+			if (i == n - 1) {
 				return -1;
 			}
-			else if (numOfArgs - i - 1 == 1) {
-				// There is only one argument after the "<" operator.
-				in = 1;
-				input = args[i + 1];
-				out = 0;
-				return i;
+			if (args[i][0] == '|') {
+				s = NULL;
+				args[i] = NULL;
 			}
-			else if (numOfArgs - i - 1 == 2) {
-				if (strcmp(args[numOfArgs - 1], "&") == 0) {
-					b = 1;
-					in = 1;
-					input = args[i + 1];
-					out = 0;
-					return i;
-				}
-				else {
-					return -1;
-				}
-			}
-			else if (numOfArgs - i - 1 == 3) {
-				if (strcmp(args[i + 2], ">") == 0) {
-					// Both input redirection and output redirection
-					// is needed.
-					in = 1;
-					input = args[i + 1];
-					out = 1;
-					output = args[i + 3];
-					return i;
-				}
-				else {
-					return -1;
-				}
-			}
-			else if (numOfArgs - i - 1 == 4) {
-				if (strcmp(args[i + 2], ">") == 0) {
-					if (strcmp(args[numOfArgs - 1], "&") == 0) {
-						b = 1;
-						in = 1;
-						input = args[i + 1];
-						out = 1;
-						output = args[i + 3];
-						return i;
-					}
-					else {
-						return -1;
-					}
-				}
-				else {
+			else {
+				char** file = args[i][0] == '<' ? &s->input : &s->output;
+				// A stream is redirected once, to a file.
+				if (*file != NULL || strcmp(args[i + 1], "|") == 0 ||
+					strcmp(args[i + 1], "<") == 0 || strcmp(args[i + 1], ">") == 0) {
 					return -1;
 				}
-			}
-			else {
-				return -1;
+				*file = args[i + 1];
+				args[i++] = NULL;
+				redirected = 1;
 			}
 		}
-		else if (strcmp(args[i], "|") == 0) {
-			if (i == 0 || i == numOfArgs - 1) {
-				return -1;
-			}
-			else {
-				// Pipeline is needed.
-				pl = 1;
-				return i;
-			}
+		else if (redirected) {
+			// Only another redirection may follow a file name.
+			return -1;
 		}
 	}
-	if (strcmp(args[numOfArgs - 1], "&") == 0) {
-		b = 1;
-		return (numOfArgs - 1);
+	for (int i = 0; i < cmd->numOfStages; i++) {
+		// Only the first stage reads a file and only the last writes one;
+		// the others use the pipes.
+		if ((i > 0 && cmd->stages[i].input != NULL) ||
+			(i < cmd->numOfStages - 1 && cmd->stages[i].output != NULL)) {
+			return -1;
+		}
 	}
 	return 0;
 }
@@ -266,132 +241,115 @@ int mysh_pwd(void) {
 	}
 }
 
+/**
+ * Start every stage of cmd at once, each reading the pipe from the stage
+ * before and writing the pipe to the stage after, all in one new process
+ * group. Return the group, or 0 if no stage could be started.
+ */
+pid_t mysh_spawn(struct command* cmd) {
+	pid_t group = 0;
+	int prev = -1;  /* Read end of the pipe from the previous stage */
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	// The shell ignores SIGTTOU to take the terminal back; its children do not.
+	sigset_t defaults;
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGTTOU);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+	for (int i = 0; i < cmd->numOfStages; i++) {
+		struct stage* s = &cmd->stages[i];
+		int p[2] = {-1, -1};
+		// Pipes are only made between stages, close-on-exec so that each
+		// stage holds just the ends it was given.
+		if (i < cmd->numOfStages - 1 && pipe2(p, O_CLOEXEC) == -1) {
+			write(STDERR_FILENO, error_message, strlen(error_message));
+			break;
+		}
+		// The files are opened here and every stream is put at STAGE_IN and
+		// STAGE_OUT, so that the same file actions serve every stage.
+		int in = prev != -1 ? prev : STDIN_FILENO;
+		int out = p[1] != -1 ? p[1] : STDOUT_FILENO;
+		int opened_in = 0, opened_out = 0;  /* Whether in and out are files opened here */
+		if (s->input != NULL) {
+			in = open(s->input, O_RDONLY | O_CLOEXEC);
+			opened_in = in != -1;
+		}
+		if (s->output != NULL && in != -1) {
+			out = open(s->output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRWXU);
+			opened_out = out != -1;
+		}
+		// The first stage started leads the group and the others join it.
+		posix_spawnattr_setpgroup(&attr, group);
+		pid_t pid;
+		if (in == -1 || out == -1 || dup3(in, STAGE_IN, O_CLOEXEC) == -1 ||
+			dup3(out, STAGE_OUT, O_CLOEXEC) == -1 ||
+			posix_spawnp(&pid, s->argv[0], &stage_actions, &attr, s->argv, environ) != 0) {
+			write(STDERR_FILENO, error_message, strlen(error_message));
+		}
+		else if (group == 0) {
+			group = pid;
+		}
+		if (opened_in) {
+			close(in);
+		}
+		if (opened_out) {
+			close(out);
+		}
+		if (prev != -1) {
+			close(prev);
+		}
+		if (p[1] != -1) {
+			close(p[1]);
+		}
+		prev = p[0];
+	}
+	if (prev != -1) {
+		close(prev);
+	}
+	close(STAGE_IN);
+	close(STAGE_OUT);
+	posix_spawnattr_destroy(&attr);
+	return group;
+}
+
 int mysh_child_process(char** args) {
-	pid_t pid1;
-	pid_t pid2;
-	int p[2];
+	struct command cmd;
 	// Check if redirection or pipeline is needed.
-	int rv = mysh_redirection(args);
+	int rv = mysh_redirection(args, &cmd);
 	if (rv == -2) {
 		numOfCommand--;
 		return EXIT_SUCCESS;
 	}
-	// Create a pipe for interprocess communication.
-	if (pipe(p) == -1) {
+	// The command does not have the right format.
+	if (rv == -1) {
 		write(STDERR_FILENO, error_message, strlen(error_message));
 		return EXIT_FAILURE;
 	}
-	pid1 = fork();
-	if (pid1 < 0) {
-		write(STDERR_FILENO, error_message, strlen(error_message));
+	pid_t group = mysh_spawn(&cmd);
+	if (group == 0) {
 		return EXIT_FAILURE;
 	}
-	else if (pid1 == 0) {
-		// The command does not have the right format.
-		if (rv == -1) {
-			write(STDERR_FILENO, error_message, strlen(error_message));
-			exit(1);
-		}
-		else if (rv == 0) {
-			// Redirection or pipeline is not needed.
-			// Do nothing.
-		}
-		else {
-			if (out) {
-				int newfd_out = open(output, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-				if (newfd_out == -1) {
-					write(STDERR_FILENO, error_message, strlen(error_message));
-					exit(1);
-				}
-				// The standard output of the program is rerouted to a specified
-				// file.
-				if (dup2(newfd_out, STDOUT_FILENO) == -1) {
-					write(STDERR_FILENO, error_message, strlen(error_message));
-					exit(1);
-				}
-				// The arguments of the program is terminated with a NULL pointer.
-				args[rv] = NULL;
-			}
-			if (in) {
-				int newfd_in = open(input, O_RDONLY);
-				if (newfd_in == -1) {
-					write(STDERR_FILENO, error_message, strlen(error_message));
-					exit(1);
-				}
-				if (dup2(newfd_in, STDIN_FILENO) == -1) {
-					write(STDERR_FILENO, error_message, strlen(error_message));
-					exit(1);
-				}
-				args[rv] = NULL;
-			}
-			if (b) {
-				args[rv] = NULL;
-			}
-			if (pl) {
-				// Close unused read end.
-				close(p[0]);
-				if (dup2(p[1], STDOUT_FILENO) == -1) {
-					write(STDERR_FILENO, error_message, strlen(error_message));
-					exit(1);
-				}
-				close(p[1]);
-				args[rv] = NULL;
-			}
-			else {
-				// Close both ends of the pipe if no pipeline is needed.
-				close(p[0]);
-				close(p[1]);
-			}
-		}
-		if (execvp(args[0], args) == -1) {
-			write(STDERR_FILENO, error_message, strlen(error_message));
-		}
-		exit(1);
-	}
-	if (b) {
-		// Close both ends of the pipe.
-		close(p[0]);
-		close(p[1]);
+	if (cmd.background) {
 		for (int i = 0; i < 20; i++) {
 			if (processes[i] == 0) {
-				processes[i] = pid1;
+				processes[i] = group;
 				break;
 			}
 		}
+		return EXIT_SUCCESS;
 	}
-	else {
-		if (pl) {
-			pid2 = fork();
-			if (pid2 < 0) {
-				write(STDERR_FILENO, error_message, strlen(error_message));
-				return EXIT_FAILURE;
-			}
-			else if (pid2 == 0) {
-				close(p[1]);
-				if (dup2(p[0], STDIN_FILENO) == -1) {
-					write(STDERR_FILENO, error_message, strlen(error_message));
-					exit(1);
-				}
-				close(p[0]);
-				// The number of arguments of the second program.
-				int num = numOfArgs - rv;
-				char* second_args[num];
-				for (int i = 0; i < num - 1; i++) {
-					second_args[i] = args[rv + 1 + i];
-				}
-				second_args[num - 1] = NULL;
-				if (execvp(second_args[0], second_args) == -1) {
-					write(STDERR_FILENO, error_message, strlen(error_message));
-				}
-				exit(1);
-			}
-		}
-		close(p[0]);
-		close(p[1]);
-		waitpid(pid1, NULL, 0);
-		if (pl) {
-			waitpid(pid2, NULL, 0);
-		}
+	// Hand the terminal to the group while it runs, and wake any stage
+	// stopped for reading it before it was handed over.
+	int tty = isatty(STDIN_FILENO);
+	if (tty) {
+		tcsetpgrp(STDIN_FILENO, group);
+		kill(-group, SIGCONT);
+	}
+	while (waitpid(-group, NULL, 0) > 0) {
+	}
+	if (tty) {
+		tcsetpgrp(STDIN_FILENO, getpgrp());
 	}
 	return EXIT_SUCCESS;
 }
@@ -407,7 +365,6 @@ int mysh_execute(char* line, char** args) {
 	if (strcmp(args[0], "exit") == 0) {
 		mysh_kill();
 		free(line);
-		free(args);
 		exit(0);
 	}
 	else if (strcmp(args[0], "cd") == 0) {
@@ -424,12 +381,16 @@ int mysh_execute(char* line, char** args) {
 }
 
 /**
- * Wait for the terminated child.
+ * Wait for the terminated children. A background command is done when
+ * no process of its group is left.
  */
 void mysh_wait(void) {
 	for (int i = 0; i < 20; i++) {
 		if (processes[i] != 0) {
-			if (waitpid(processes[i], NULL, WNOHANG) != 0) {
+			pid_t pid;
+			while ((pid = waitpid(-processes[i], NULL, WNOHANG)) > 0) {
+			}
+			if (pid == -1) {
 				processes[i] = 0;
 			}
 		}
@@ -443,6 +404,7 @@ void mysh_loop(void) {
 	char* line;
 	char** arguments;
 	while (1) {
+		mysh_reset();
 		mysh_wait();
 		fprintf(stdout, "mysh (%d)> ", numOfCommand);
 		fflush(stdout);
@@ -450,17 +412,15 @@ void mysh_loop(void) {
 		if (strlen(line) > MAX_SIZE) {
 			numOfCommand++;
 			write(STDERR_FILENO, error_message, strlen(error_message));
-			free(line);
 			continue;
 		}
 		arguments = mysh_parse_line(line);
+		if (arguments == NULL) {
+			numOfCommand++;
+			write(STDERR_FILENO, error_message, strlen(error_message));
+			continue;
+		}
 		mysh_execute(line, arguments);
-		free(line);
-		free(arguments);
-		in = 0;
-		out = 0;
-		pl = 0;
-		b = 0;
 	}
 }
 
@@ -472,6 +432,11 @@ int main(int argc, char* argv[]) {
 		write(STDERR_FILENO, error_message, strlen(error_message));
 		exit(1);
 	}
+	// Take the terminal back from finished commands without being stopped.
+	signal(SIGTTOU, SIG_IGN);
+	posix_spawn_file_actions_init(&stage_actions);
+	posix_spawn_file_actions_adddup2(&stage_actions, STAGE_IN, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&stage_actions, STAGE_OUT, STDOUT_FILENO);
 	mysh_loop();
 	exit(0);
 }
@@ -0,0 +1,170 @@
+#!/bin/sh
+# Check the error paths of xv6_fsck, then time it on a generated image in each
+# of its reading modes.
+#
+# Usage: bench.sh [--check | image [mkimage options]]
+# Each error mkimage --corrupt injects must be reported with its message and
+# exit status 1, also by a dry run of the repairs, and the errors of the
+# original twelve checks must match those of the multi-pass checker of the
+# first commit. With --check, nothing is timed.
+# The image to time is made once with mkimage and reused while it exists;
+# pass mkimage options to make a different one. Throughput is reported in
+# inodes checked per second and image bytes per second. The multi-pass
+# checker is then timed against xv6_fsck on a small image of 512-byte blocks
+# with a single bitmap block, the only geometry it reads.
+
+cd "$(dirname "$0")" || exit 1
+make -s xv6_fsck mkimage || exit 1
+
+# The message of each check, in the order of their numbers. A cycle through
+# the root also links it twice, which is reported first. Error 17 is check 10
+# for an entry past the inode table.
+messages="bad inode.
+directory not properly formatted.
+root directory does not exist.
+bad direct address in inode.
+bad indirect address in inode.
+direct address used more than once.
+address used by inode but marked free in bitmap.
+bitmap marks block in use but it is not in use.
+inode marked use but not found in a directory.
+inode referred to in directory but marked free.
+directory appears more than once in file system.
+bad reference count for file.
+parent directory mismatch.
+directory appears more than once in file system.
+inode not reachable from root directory.
+duplicate name in directory.
+inode referred to in directory but marked free."
+
+# Run the checker and record its output and exit status.
+fsck() {
+	"$@" > "$tmp/out" 2>&1
+	status=$?
+}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+# The multi-pass checker, which knows 512-byte blocks and checks 1 ~ 12.
+root=$(git rev-list --max-parents=0 HEAD 2> /dev/null)
+if [ -n "$root" ] && git show "$root:project5/xv6_fsck.c" > "$tmp/baseline.c" &&
+	${CC:-gcc} -O2 -w -I. -o "$tmp/baseline" "$tmp/baseline.c"; then
+	baseline=$tmp/baseline
+else
+	echo "multi-pass checker not built; not compared or timed."
+	baseline=
+fi
+
+check_errors() {
+	failed=0
+	for c in 0 $(seq 1 17); do
+		# Small enough for the geometry of the multi-pass checker.
+		corrupt=
+		[ "$c" -ne 0 ] && corrupt="--corrupt $c"
+		# shellcheck disable=SC2086
+		./mkimage --size 2048 --inodes 256 $corrupt "$tmp/image" > /dev/null || exit 1
+		if [ "$c" -eq 0 ]; then
+			expected=
+			expected_status=0
+		else
+			expected="ERROR: $(echo "$messages" | sed -n "${c}p")"
+			expected_status=1
+		fi
+		result=ok
+		fsck ./xv6_fsck "$tmp/image"
+		if [ $status -ne $expected_status ] || [ "$(cat "$tmp/out")" != "$expected" ]; then
+			echo "check $c: got exit $status: $(cat "$tmp/out")"
+			result=FAIL
+		fi
+		# Every violation is listed, including the one injected.
+		fsck ./xv6_fsck --all "$tmp/image"
+		if [ $status -ne $expected_status ] ||
+			{ [ "$c" -ne 0 ] && ! grep -q "check=$((c > 16 ? 10 : c))(" "$tmp/out"; }; then
+			echo "check $c: --all got exit $status"
+			result=FAIL
+		fi
+		# A dry run writes nothing, so the image is still in error.
+		fsck ./xv6_fsck --repair --dry-run "$tmp/image"
+		if [ $status -ne $expected_status ]; then
+			echo "check $c: --repair --dry-run got exit $status"
+			result=FAIL
+		fi
+		if [ -n "$baseline" ] && [ "$c" -le 12 ]; then
+			fsck ./xv6_fsck "$tmp/image"
+			mv "$tmp/out" "$tmp/fused"
+			fused=$status
+			fsck "$baseline" "$tmp/image"
+			if [ $status -ne $fused ] || ! cmp -s "$tmp/out" "$tmp/fused"; then
+				echo "check $c: multi-pass checker got exit $status: $(cat "$tmp/out")"
+				result=FAIL
+			fi
+		fi
+		printf "check %-2d %s\n" "$c" $result
+		[ $result = ok ] || failed=1
+	done
+	return $failed
+}
+
+check_errors
+failed=$?
+[ "$1" = --check ] && exit $failed
+
+image=${1:-/tmp/xv6_bench.img}
+[ $# -gt 0 ] && shift
+options=${*:---block-size 4096 --size 262144 --inodes 65536 --depth 3 --fanout 8 --mean-size 8192}
+if [ ! -f "$image" ]; then
+	# shellcheck disable=SC2086
+	./mkimage $options "$image" || exit 1
+fi
+bsize=$(echo "$options" | sed -n 's/.*--block-size \([0-9]*\).*/\1/p')
+case "$options" in
+*--double-indirect*) layout=--double-indirect ;;
+esac
+
+# Usage: timed label file block_size repeat command...
+# Run command on file, an image of block_size-byte blocks, repeat times and
+# print the time of one run.
+timed() {
+	label=$1
+	file=$2
+	block_size=$3
+	repeat=$4
+	shift 4
+	bytes=$(wc -c < "$file")
+	# The number of inodes is the third word of the superblock.
+	inodes=$(od -A n -t u4 -j "$block_size" -N 12 "$file" | awk '{ print $3 }')
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt "$repeat" ]; do
+		"$@" "$file"
+		status=$?
+		i=$((i + 1))
+	done
+	end=$(date +%s%N)
+	ns=$(((end - start) / repeat))
+	[ $ns -eq 0 ] && ns=1
+	awk -v mode="$label" -v ns=$ns -v inodes="$inodes" -v bytes="$bytes" -v status=$status 'BEGIN {
+		printf "%-18s exit %d %9.1f ms %12.0f inodes/s %8.2f GB/s\n",
+			mode, status, ns / 1e6, inodes / (ns / 1e9), bytes / ns
+	}'
+}
+
+run() {
+	# shellcheck disable=SC2086
+	timed "${*:-mmap}" "$image" "${bsize:-512}" 1 ./xv6_fsck --block-size "${bsize:-512}" $layout "$@"
+}
+
+run
+run --stream
+run --stream --direct
+
+if [ -n "$baseline" ]; then
+	small=/tmp/xv6_bench_512.img
+	if [ ! -f "$small" ]; then
+		./mkimage --size 4000 --inodes 2048 --depth 3 --fanout 6 --mean-size 768 "$small" || exit 1
+	fi
+	echo "512-byte blocks, mean of 100 runs:"
+	timed multi-pass "$small" 512 100 "$baseline"
+	timed xv6_fsck "$small" 512 100 ./xv6_fsck
+fi
+exit $failed
@@ -0,0 +1,77 @@
+#include <string.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#include "bitmap.h"
+
+/**
+ * Compare one 64-bit word at a time.
+ */
+uint bitmap_mismatch_scalar(const uint64_t* a, const uint64_t* b, uint from, uint to) {
+	for (uint w = from; w < to; w++) {
+		if (a[w] != b[w]) {
+			return w;
+		}
+	}
+	return to;
+}
+
+#ifdef __x86_64__
+/**
+ * Compare 128 bits at a time. SSE2 is part of x86-64, so this needs no check.
+ */
+uint bitmap_mismatch_sse2(const uint64_t* a, const uint64_t* b, uint from, uint to) {
+	uint w = from;
+	for (; w + 2 <= to; w += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + w));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + w));
+		// All 16 bytes are equal if every byte compares equal.
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+			break;
+		}
+	}
+	return bitmap_mismatch_scalar(a, b, w, to);
+}
+
+/**
+ * Compare 256 bits at a time.
+ */
+__attribute__((target("avx2")))
+uint bitmap_mismatch_avx2(const uint64_t* a, const uint64_t* b, uint from, uint to) {
+	uint w = from;
+	for (; w + 4 <= to; w += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)(a + w));
+		__m256i y = _mm256_loadu_si256((const __m256i*)(b + w));
+		__m256i diff = _mm256_xor_si256(x, y);
+		if (!_mm256_testz_si256(diff, diff)) {
+			break;
+		}
+	}
+	return bitmap_mismatch_scalar(a, b, w, to);
+}
+
+#else
+uint bitmap_mismatch_sse2(const uint64_t* a, const uint64_t* b, uint from, uint to) {
+	return bitmap_mismatch_scalar(a, b, from, to);
+}
+
+uint bitmap_mismatch_avx2(const uint64_t* a, const uint64_t* b, uint from, uint to) {
+	return bitmap_mismatch_scalar(a, b, from, to);
+}
+#endif
+
+/**
+ * Pick the kernel for this CPU on the first call, then forward to it.
+ */
+uint bitmap_mismatch(const uint64_t* a, const uint64_t* b, uint from, uint to) {
+	static uint (*kernel)(const uint64_t*, const uint64_t*, uint, uint) = NULL;
+	if (kernel == NULL) {
+#ifdef __x86_64__
+		__builtin_cpu_init();
+		kernel = __builtin_cpu_supports("avx2") ? bitmap_mismatch_avx2 : bitmap_mismatch_sse2;
+#else
+		kernel = bitmap_mismatch_scalar;
+#endif
+	}
+	return kernel(a, b, from, to);
+}
@@ -0,0 +1,18 @@
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include <stdint.h>
+#include "types.h"
+
+// Kernels that compare two bit sets stored as arrays of 64-bit words, such as
+// the on-disk bitmap and the set of blocks found in use. Each returns the
+// index of the first word in [from, to) where a and b differ, or to if they
+// are equal over the whole range.
+uint bitmap_mismatch_scalar(const uint64_t* a, const uint64_t* b, uint from, uint to);
+uint bitmap_mismatch_sse2(const uint64_t* a, const uint64_t* b, uint from, uint to);
+uint bitmap_mismatch_avx2(const uint64_t* a, const uint64_t* b, uint from, uint to);
+
+// The fastest kernel the CPU supports, chosen on the first call.
+uint bitmap_mismatch(const uint64_t* a, const uint64_t* b, uint from, uint to);
+
+#endif // _BITMAP_H_
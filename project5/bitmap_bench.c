@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bitmap.h"
+
+/**
+ * Return the current time in seconds.
+ */
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The loop xv6_fsck used before the kernels: one shift and mask per block.
+ * Return the first block whose bits differ, or nbits.
+ */
+uint per_block(const uint64_t* a, const uint64_t* b, uint from, uint to) {
+	const uchar* x = (const uchar*)a;
+	const uchar* y = (const uchar*)b;
+	for (uint addr = from * 64; addr < to * 64; addr++) {
+		if (((x[addr / 8] >> (addr % 8)) & 1) != ((y[addr / 8] >> (addr % 8)) & 1)) {
+			return addr / 64;
+		}
+	}
+	return to;
+}
+
+/**
+ * Time a kernel over two equal bit sets of nwords words and print its
+ * throughput. The best of several runs is reported.
+ */
+void bench(const char* name, uint (*kernel)(const uint64_t*, const uint64_t*, uint, uint),
+	const uint64_t* a, const uint64_t* b, uint nwords) {
+	double best = 1e9;
+	for (int run = 0; run < 5; run++) {
+		double start = now();
+		uint w = kernel(a, b, 0, nwords);
+		double elapsed = now() - start;
+		if (w != nwords) {
+			fprintf(stderr, "%s: unexpected mismatch at word %u\n", name, w);
+			exit(1);
+		}
+		if (elapsed < best) {
+			best = elapsed;
+		}
+	}
+	double bytes = (double)nwords * 8;
+	printf("%-10s %8.3f ms %8.2f GB/s of bitmap %8.2f Gblocks/s\n", name, best * 1e3,
+		bytes / best / 1e9, bytes * 8 / best / 1e9);
+}
+
+int main(int argc, char* argv[]) {
+	// Default to the bitmap of a 64 GB image of 512-byte blocks.
+	uint nbits = argc > 1 ? strtoul(argv[1], NULL, 10) : 1u << 27;
+	uint nwords = (nbits + 63) / 64;
+	uint64_t* a = malloc(sizeof(uint64_t) * nwords);
+	uint64_t* b = malloc(sizeof(uint64_t) * nwords);
+	srand(537);
+	for (uint w = 0; w < nwords; w++) {
+		a[w] = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ rand();
+	}
+	memcpy(b, a, sizeof(uint64_t) * nwords);
+	printf("%u blocks, %u words\n", nwords * 64, nwords);
+	bench("per-block", per_block, a, b, nwords);
+	bench("scalar", bitmap_mismatch_scalar, a, b, nwords);
+	bench("sse2", bitmap_mismatch_sse2, a, b, nwords);
+	// Like the dispatch in bitmap.c, only run AVX2 where the CPU has it.
+	int avx2 = 1;
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	avx2 = __builtin_cpu_supports("avx2");
+#endif
+	if (avx2) {
+		bench("avx2", bitmap_mismatch_avx2, a, b, nwords);
+	}
+	else {
+		printf("%-10s skipped: the CPU does not support AVX2\n", "avx2");
+	}
+	bench("dispatch", bitmap_mismatch, a, b, nwords);
+	free(a);
+	free(b);
+	return 0;
+}
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dirindex.h"
+
+/**
+ * Return the FNV-1a hash of a name of at most DIRSIZ characters.
+ */
+static uint name_hash(const char* name) {
+	uint h = 2166136261u;
+	for (uint i = 0; i < DIRSIZ && name[i] != '\0'; i++) {
+		h = (h ^ (uchar)name[i]) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Return the slot holding name, or the empty slot where it would go.
+ */
+static uint* find_slot(struct dir_index* index, const char* name) {
+	uint mask = index->nslots - 1;
+	for (uint i = name_hash(name) & mask;; i = (i + 1) & mask) {
+		uint* slot = &index->slots[i];
+		if (*slot == 0 || strncmp(index->entries[*slot - 1].name, name, DIRSIZ) == 0) {
+			return slot;
+		}
+	}
+}
+
+/**
+ * Make room for n slots and put every entry back into them. Return 0 on
+ * success. Return -1 if memory runs out, leaving the index as it was.
+ */
+static int rehash(struct dir_index* index, uint n) {
+	if (n > index->slot_capacity) {
+		uint* slots = realloc(index->slots, sizeof(uint) * n);
+		if (slots == NULL) {
+			return -1;
+		}
+		index->slots = slots;
+		index->slot_capacity = n;
+	}
+	index->nslots = n;
+	memset(index->slots, 0, sizeof(uint) * n);
+	for (uint i = 0; i < index->nentries; i++) {
+		*find_slot(index, index->entries[i].name) = i + 1;
+	}
+	return 0;
+}
+
+/**
+ * Empty index for a directory expected to hold about expected entries. The
+ * memory of earlier directories is reused; only the slots needed are cleared.
+ * Return 0 on success. Return -1 if memory runs out.
+ */
+int dir_index_reset(struct dir_index* index, uint expected) {
+	uint n = 16;
+	while (n / 2 < expected && n < 0x80000000u) {
+		n *= 2;
+	}
+	index->nentries = 0;
+	return rehash(index, n);
+}
+
+/**
+ * Add a copy of entry. Return 1 if an entry with the same name was already
+ * added, 0 if the name is new. Return -1 if memory runs out.
+ */
+int dir_index_add(struct dir_index* index, const struct dirent* entry) {
+	// Keep the table at most half full.
+	if (2 * (index->nentries + 1) > index->nslots && rehash(index, 2 * index->nslots) == -1) {
+		return -1;
+	}
+	uint* slot = find_slot(index, entry->name);
+	if (*slot != 0) {
+		return 1;
+	}
+	if (index->nentries == index->capacity) {
+		uint capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+		struct dirent* entries = realloc(index->entries, sizeof(struct dirent) * capacity);
+		if (entries == NULL) {
+			return -1;
+		}
+		index->entries = entries;
+		index->capacity = capacity;
+	}
+	index->entries[index->nentries] = *entry;
+	*slot = ++index->nentries;
+	return 0;
+}
+
+/**
+ * Return the entry named name, or NULL if there is none.
+ */
+struct dirent* dir_index_lookup(struct dir_index* index, const char* name) {
+	uint* slot = find_slot(index, name);
+	return *slot == 0 ? NULL : &index->entries[*slot - 1];
+}
+
+/**
+ * Free the memory of index.
+ */
+void dir_index_free(struct dir_index* index) {
+	free(index->entries);
+	free(index->slots);
+	memset(index, 0, sizeof(*index));
+}
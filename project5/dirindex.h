@@ -0,0 +1,24 @@
+#ifndef _DIRINDEX_H_
+#define _DIRINDEX_H_
+
+#include "types.h"
+#include "fs.h"
+
+// Hash index of the names in one directory. Entries are copied into an arena
+// that is kept between directories, and an open-addressing table with linear
+// probing maps names to them. Reset it for each directory.
+struct dir_index {
+	struct dirent* entries;  /* Entries added since the last reset. */
+	uint nentries;           /* Number of entries. */
+	uint capacity;           /* Allocated entries. */
+	uint* slots;             /* 1 + index of an entry, 0 if the slot is empty. */
+	uint nslots;             /* Slots in use, a power of two. */
+	uint slot_capacity;      /* Allocated slots. */
+};
+
+int dir_index_reset(struct dir_index* index, uint expected);
+int dir_index_add(struct dir_index* index, const struct dirent* entry);
+struct dirent* dir_index_lookup(struct dir_index* index, const char* name);
+void dir_index_free(struct dir_index* index);
+
+#endif // _DIRINDEX_H_
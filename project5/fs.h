@@ -22,6 +22,13 @@ struct superblock {
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
 
+// Large-file variant of the format: addrs[NDIRECT_DI] is the indirect block
+// and addrs[NDIRECT_DI + 1] a double-indirect block holding the addresses of
+// NINDIRECT more indirect blocks. The inode keeps its size.
+#define NDIRECT_DI (NDIRECT - 1)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE_DI (NDIRECT_DI + NINDIRECT + NDINDIRECT)
+
 // On-disk inode structure
 struct dinode {
 	short type;           // File type
@@ -44,6 +51,13 @@ struct dinode {
 // Block containing bit for block b
 #define BBLOCK(b, ninodes) (b/BPB + (ninodes)/IPB + 3)
 
+// The same quantities for images made with a block size other than BSIZE.
+// The superblock does not record the block size, so tools take it as a
+// parameter.
+#define NINDIRECT_OF(bsize) ((bsize) / sizeof(uint))
+#define IPB_OF(bsize)       ((bsize) / sizeof(struct dinode))
+#define BPB_OF(bsize)       ((bsize) * 8)
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
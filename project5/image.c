@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "image.h"
+
+/**
+ * Open the image at path, mapping it into memory unless IMAGE_STREAM is set.
+ * The size is taken from the end of the file rather than from fstat(), which
+ * reports 0 for block devices. Return 0 on success. Return -1 if there is an
+ * error, with a message printed.
+ */
+int image_open(struct image* img, const char* path, int flags) {
+	int writable = flags & IMAGE_WRITE;
+	int oflags = writable ? O_RDWR : O_RDONLY;
+	if ((flags & IMAGE_STREAM) && (flags & IMAGE_DIRECT)) {
+		oflags |= O_DIRECT;
+	}
+	img->flags = flags;
+	img->map = NULL;
+	// open() returns -1 if an error occured.
+	img->fd = open(path, oflags);
+	if (img->fd < 0) {
+		fprintf(stderr, "image not found.\n");
+		return -1;
+	}
+	off_t end = lseek(img->fd, 0, SEEK_END);
+	if (end == -1) {
+		fprintf(stderr, "lseek() failed.\n");
+		return -1;
+	}
+	img->bytes = end;
+	if (flags & IMAGE_STREAM) {
+		return 0;
+	}
+	// Repairs write through a shared mapping; a dry run writes to a private
+	// copy-on-write mapping instead.
+	int prot = PROT_READ;
+	if (flags & (IMAGE_WRITE | IMAGE_PRIVATE)) {
+		prot |= PROT_WRITE;
+	}
+	void* map = mmap(NULL, img->bytes, prot, writable ? MAP_SHARED : MAP_PRIVATE, img->fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap() failed.\n");
+		return -1;
+	}
+	img->map = map;
+	return 0;
+}
+
+/**
+ * Read length bytes at offset into buf. With IMAGE_DIRECT, buf must come from
+ * image_buffer() and offset and length must be multiples of IMAGE_ALIGN.
+ * Bytes past the end of the image read as zero. Return 0 on success. Return -1
+ * if there is an error.
+ */
+int image_read(struct image* img, void* buf, uint64_t offset, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t n = pread(img->fd, (uchar*)buf + done, length - done, offset + done);
+		if (n < 0) {
+			fprintf(stderr, "pread() failed.\n");
+			return -1;
+		}
+		if (n == 0) {
+			// End of the image.
+			for (; done < length; done++) {
+				((uchar*)buf)[done] = 0;
+			}
+			break;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/**
+ * Start reading length bytes at offset ahead of an image_read() call.
+ */
+void image_prefetch(struct image* img, uint64_t offset, size_t length) {
+	if (img->map == NULL && !(img->flags & IMAGE_DIRECT)) {
+		posix_fadvise(img->fd, offset, length, POSIX_FADV_WILLNEED);
+	}
+}
+
+/**
+ * Allocate a buffer of length bytes suitable for image_read().
+ */
+void* image_buffer(size_t length) {
+	void* buf;
+	if (posix_memalign(&buf, IMAGE_ALIGN, length) != 0) {
+		fprintf(stderr, "posix_memalign() failed.\n");
+		exit(1);
+	}
+	return buf;
+}
+
+/**
+ * Flush changes made through a shared mapping to the image. Return 0 on
+ * success. Return -1 if there is an error.
+ */
+int image_sync(struct image* img) {
+	if (img->map != NULL && (img->flags & IMAGE_WRITE) &&
+		msync(img->map, img->bytes, MS_SYNC) == -1) {
+		fprintf(stderr, "msync() failed.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Remove the mapping, if any, and close the image. Return 0 on success. Return
+ * -1 if there is an error.
+ */
+int image_close(struct image* img) {
+	// Remove the mapped system file image from the address
+	// space of the process.
+	if (img->map != NULL && munmap(img->map, img->bytes) == -1) {
+		fprintf(stderr, "munmap() failed.\n");
+		return -1;
+	}
+	// Close the file descriptor, so that it no longer refers to any file
+	// and may be reused.
+	if (close(img->fd) == -1) {
+		fprintf(stderr, "close() failed.\n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,32 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "types.h"
+
+// Ways to open an image.
+#define IMAGE_WRITE   1 /* Map it shared and writable. */
+#define IMAGE_PRIVATE 2 /* Map it private and writable; writes are discarded. */
+#define IMAGE_STREAM  4 /* Read it with pread() instead of mapping it. */
+#define IMAGE_DIRECT  8 /* Stream it with O_DIRECT, bypassing the page cache. */
+
+// Alignment of streamed reads, enough for O_DIRECT on any device.
+#define IMAGE_ALIGN 4096
+
+// A file system image opened from a file or a block device.
+struct image {
+	int fd;          /* File descriptor of the image. */
+	int flags;       /* IMAGE_* flags it was opened with. */
+	uchar* map;      /* The whole image when mapped, NULL when streaming. */
+	uint64_t bytes;  /* Size of the image in bytes. */
+};
+
+int image_open(struct image* img, const char* path, int flags);
+int image_read(struct image* img, void* buf, uint64_t offset, size_t length);
+void image_prefetch(struct image* img, uint64_t offset, size_t length);
+void* image_buffer(size_t length);
+int image_sync(struct image* img);
+int image_close(struct image* img);
+
+#endif // _IMAGE_H_
@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <math.h>
+#include <limits.h>
+#include "fs.h"
+#include "stat.h"
+#include "types.h"
+#include "image.h"
+
+// Blocks and inodes kept free for the errors that add an inode or a block.
+#define RESERVED_BLOCKS 8
+#define RESERVED_INODES 4
+
+struct image img;                  /* The image being made. */
+uint bsize = BSIZE;                /* Block size in bytes. */
+uint size = 1024;                  /* Size of the image in blocks. */
+uint ninodes = 200;                /* Number of inodes. */
+uint nfiles = 0;                   /* Regular files to make, as many as fit if 0. */
+uint depth = 2;                    /* Levels of directories below the root. */
+uint fanout = 4;                   /* Subdirectories of each directory. */
+uint mean_size = 2048;             /* Mean size of a file in bytes. */
+uint64_t seed = 1;                 /* State of the random number generator. */
+int dindirect = 0;                 /* Inodes have a double-indirect pointer. */
+uint ndirect = NDIRECT;            /* Number of direct pointers in an inode. */
+uint nindirect;                    /* Number of addresses in an indirect block. */
+int corruption = 0;                /* Error to inject, 0 for none. */
+uint swaps = 0;                    /* Pairs of file blocks swapped to age the image. */
+struct dinode* inode_table;        /* Starting address of the inode table. */
+uchar* bitmap;                     /* Starting address of the bitmap. */
+uint data_blocks;                  /* First data block. */
+uint next_block;                   /* Next data block to allocate. */
+uint next_inode = ROOTINO;         /* Next inode to allocate. */
+uint* dirs;                        /* Directories in the order they were made. */
+uint ndirs;                        /* Number of directories. */
+uint* files;                       /* Regular files in the order they were made. */
+uint made_files;                   /* Number of regular files. */
+
+/**
+ * Return a pseudo-random number (xorshift64*).
+ */
+uint64_t next_random() {
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Return the starting address of block addr.
+ */
+void* block_ptr(uint addr) {
+	return img.map + (uint64_t)bsize * addr;
+}
+
+/**
+ * Mark block addr in use in the bitmap.
+ */
+void mark_used(uint addr) {
+	bitmap[addr / 8] |= 1 << (addr % 8);
+}
+
+/**
+ * Allocate the next data block, marking it in use.
+ */
+uint allocate_block() {
+	if (next_block >= size) {
+		fprintf(stderr, "image too small.\n");
+		exit(1);
+	}
+	mark_used(next_block);
+	return next_block++;
+}
+
+/**
+ * Allocate the next inode with the given type and one link.
+ */
+uint allocate_inode(short type) {
+	if (next_inode >= ninodes) {
+		fprintf(stderr, "too many inodes.\n");
+		exit(1);
+	}
+	struct dinode* dip = &inode_table[next_inode];
+	dip->type = type;
+	dip->nlink = 1;
+	return next_inode++;
+}
+
+/**
+ * Return where the address of the n-th block of inode inum is stored,
+ * allocating that block and the indirect blocks leading to it if needed.
+ */
+uint* block_slot(uint inum, uint n) {
+	struct dinode* dip = &inode_table[inum];
+	if (n < ndirect) {
+		if (dip->addrs[n] == 0) {
+			dip->addrs[n] = allocate_block();
+		}
+		return &dip->addrs[n];
+	}
+	n -= ndirect;
+	uint* slot;
+	if (n < nindirect) {
+		slot = &dip->addrs[ndirect];
+	}
+	else {
+		n -= nindirect;
+		if (dip->addrs[ndirect + 1] == 0) {
+			dip->addrs[ndirect + 1] = allocate_block();
+		}
+		slot = (uint*)block_ptr(dip->addrs[ndirect + 1]) + n / nindirect;
+		n %= nindirect;
+	}
+	if (*slot == 0) {
+		*slot = allocate_block();
+	}
+	uint* indirect = block_ptr(*slot);
+	if (indirect[n] == 0) {
+		indirect[n] = allocate_block();
+	}
+	return &indirect[n];
+}
+
+/**
+ * Return the address of the n-th block of inode inum, allocating it and the
+ * indirect blocks leading to it if needed.
+ */
+uint file_block(uint inum, uint n) {
+	return *block_slot(inum, n);
+}
+
+/**
+ * Return the number of blocks a file of n data blocks takes, counting its
+ * indirect blocks.
+ */
+uint file_blocks(uint n) {
+	uint total = n;
+	if (n > ndirect) {
+		total++;
+	}
+	if (n > ndirect + nindirect) {
+		total += 1 + (n - ndirect - nindirect + nindirect - 1) / nindirect;
+	}
+	return total;
+}
+
+/**
+ * Append an entry named name referring to inode inum to directory dir.
+ */
+void add_entry(uint dir, const char* name, uint inum) {
+	struct dinode* dip = &inode_table[dir];
+	uint per_block = bsize / sizeof(struct dirent);
+	uint k = dip->size / sizeof(struct dirent);
+	struct dirent* directory_entry = block_ptr(file_block(dir, k / per_block));
+	directory_entry[k % per_block].inum = inum;
+	// Names fill the whole field and are not always NUL-terminated.
+	memset(directory_entry[k % per_block].name, 0, DIRSIZ);
+	memcpy(directory_entry[k % per_block].name, name, strnlen(name, DIRSIZ));
+	dip->size += sizeof(struct dirent);
+}
+
+/**
+ * Make a directory with its "." and ".." entries, whose parent is parent.
+ */
+uint make_directory(uint parent) {
+	uint inum = allocate_inode(T_DIR);
+	add_entry(inum, ".", inum);
+	add_entry(inum, "..", parent);
+	return inum;
+}
+
+/**
+ * Make the directories: fanout subdirectories in each directory down to the
+ * given depth below the root, level by level.
+ */
+void make_directories() {
+	dirs = malloc(sizeof(uint) * ninodes);
+	dirs[ndirs++] = make_directory(ROOTINO);
+	uint level = 0, end = 1;
+	for (uint d = 0; d < depth; d++) {
+		for (uint i = level; i < end; i++) {
+			for (uint k = 0; k < fanout; k++) {
+				if (next_inode + RESERVED_INODES >= ninodes) {
+					return;
+				}
+				char name[DIRSIZ + 1];
+				snprintf(name, sizeof(name), "d%u", ndirs);
+				uint inum = make_directory(dirs[i]);
+				add_entry(dirs[i], name, inum);
+				dirs[ndirs++] = inum;
+			}
+		}
+		level = end;
+		end = ndirs;
+	}
+}
+
+/**
+ * Make the regular files in random directories. Sizes follow an exponential
+ * distribution with the given mean, limited by the largest file the inode
+ * can address. A file that does not fit in the free blocks is left empty.
+ * Fewer files are made if the blocks run out.
+ */
+void make_files() {
+	uint max_blocks = ndirect + nindirect + (dindirect ? nindirect * nindirect : 0);
+	uint wanted = nfiles != 0 ? nfiles : ninodes - next_inode - RESERVED_INODES;
+	files = malloc(sizeof(uint) * (wanted + 1));
+	for (uint f = 0; f < wanted; f++) {
+		// Stop when the directories may have no room left to grow.
+		if (next_inode + RESERVED_INODES >= ninodes || next_block + 2 > size - RESERVED_BLOCKS) {
+			break;
+		}
+		// Uniform in (0, 1].
+		double u = (double)((next_random() >> 11) + 1) / (double)(1ULL << 53);
+		double bytes = -log(u) * mean_size;
+		uint n = (uint)((bytes + bsize - 1) / bsize);
+		if (n > max_blocks) {
+			n = max_blocks;
+		}
+		// Leave room for the directory to grow.
+		if (next_block + file_blocks(n) + 2 > size - RESERVED_BLOCKS) {
+			n = 0;
+			bytes = 0;
+		}
+		uint dir = dirs[next_random() % ndirs];
+		uint inum = allocate_inode(T_FILE);
+		for (uint j = 0; j < n; j++) {
+			uint addr = file_block(inum, j);
+			// Tag each data block with its owner.
+			*(uint*)block_ptr(addr) = inum;
+		}
+		// A file cut down to fewer blocks is cut down in size too.
+		if (bytes > (double)n * bsize) {
+			bytes = (double)n * bsize;
+		}
+		inode_table[inum].size = bytes > UINT_MAX ? UINT_MAX : (uint)bytes;
+		char name[DIRSIZ + 1];
+		snprintf(name, sizeof(name), "f%u", made_files);
+		add_entry(dir, name, inum);
+		files[made_files++] = inum;
+	}
+}
+
+/**
+ * Age the image by swapping random data blocks of random files, contents and
+ * all, as if the files had been written a piece at a time.
+ */
+void age_files() {
+	for (uint s = 0; s < swaps && made_files != 0; s++) {
+		uint a = files[next_random() % made_files];
+		uint b = files[next_random() % made_files];
+		uint na = ((uint64_t)inode_table[a].size + bsize - 1) / bsize;
+		uint nb = ((uint64_t)inode_table[b].size + bsize - 1) / bsize;
+		if (na == 0 || nb == 0) {
+			continue;
+		}
+		uint* x = block_slot(a, next_random() % na);
+		uint* y = block_slot(b, next_random() % nb);
+		uchar* buf = malloc(bsize);
+		memcpy(buf, block_ptr(*x), bsize);
+		memcpy(block_ptr(*x), block_ptr(*y), bsize);
+		memcpy(block_ptr(*y), buf, bsize);
+		free(buf);
+		uint addr = *x;
+		*x = *y;
+		*y = addr;
+	}
+}
+
+/**
+ * Return the k-th regular file with at least one data block, or 0 if there
+ * is none.
+ */
+uint file_with_data(uint k) {
+	for (uint i = 0; i < made_files; i++) {
+		if (inode_table[files[i]].addrs[0] != 0 && k-- == 0) {
+			return files[i];
+		}
+	}
+	return 0;
+}
+
+/**
+ * Return the first directory entry of directory dir.
+ */
+struct dirent* first_entries(uint dir) {
+	return block_ptr(inode_table[dir].addrs[0]);
+}
+
+/**
+ * Inject the error that xv6_fsck reports as the given check, numbered from 1
+ * in the order of its checks. Each change is the smallest that makes that
+ * error the first one reported, except for a directory cycle, which also
+ * links a directory twice. Check 17 is the second form of check 10, an entry
+ * referring to an inode that does not exist. Return 0 on success. Return -1 if
+ * the image has nothing to inject the error into.
+ */
+int inject(int check) {
+	uint file = file_with_data(0);
+	uint other = file_with_data(1);
+	uint subdir = ndirs > 1 ? dirs[1] : 0;
+	uint inum;
+	switch (check) {
+	case 1:
+		// Bad inode type.
+		if (file == 0) {
+			return -1;
+		}
+		inode_table[file].type = 7;
+		break;
+	case 2:
+		// "." does not refer to the directory itself.
+		if (subdir == 0) {
+			return -1;
+		}
+		first_entries(subdir)[0].inum = ROOTINO;
+		break;
+	case 3:
+		// ".." of the root is not the root.
+		first_entries(ROOTINO)[1].inum = subdir != 0 ? subdir : next_inode;
+		break;
+	case 4:
+		// Bad direct address.
+		if (file == 0) {
+			return -1;
+		}
+		inode_table[file].addrs[0] = size + 1;
+		break;
+	case 5:
+		// Bad indirect address.
+		if (file == 0) {
+			return -1;
+		}
+		inode_table[file].addrs[ndirect] = size + 1;
+		break;
+	case 6:
+		// A direct address used twice.
+		if (other == 0) {
+			return -1;
+		}
+		inode_table[other].addrs[0] = inode_table[file].addrs[0];
+		break;
+	case 7:
+		// A block in use marked free.
+		if (file == 0) {
+			return -1;
+		}
+		bitmap[inode_table[file].addrs[0] / 8] &= ~(1 << (inode_table[file].addrs[0] % 8));
+		break;
+	case 8:
+		// A free block marked in use.
+		if (next_block >= size) {
+			return -1;
+		}
+		mark_used(next_block);
+		break;
+	case 9:
+		// An inode in use in no directory.
+		allocate_inode(T_FILE);
+		break;
+	case 10:
+		// An entry referring to a free inode.
+		add_entry(ROOTINO, "free", next_inode);
+		break;
+	case 11:
+		// A directory linked twice.
+		if (subdir == 0) {
+			return -1;
+		}
+		add_entry(ROOTINO, "again", subdir);
+		break;
+	case 12:
+		// A link count that does not match the entries.
+		if (file == 0) {
+			return -1;
+		}
+		inode_table[file].nlink++;
+		break;
+	case 13:
+		// ".." of a directory that is not its parent.
+		if (subdir == 0) {
+			return -1;
+		}
+		first_entries(subdir)[1].inum = subdir;
+		break;
+	case 14:
+		// A directory containing the root.
+		if (subdir == 0) {
+			return -1;
+		}
+		add_entry(subdir, "up", ROOTINO);
+		break;
+	case 15:
+		// Two directories referring only to each other.
+		inum = make_directory(next_inode + 1);
+		add_entry(inum, "y", make_directory(inum));
+		add_entry(inum + 1, "x", inum);
+		break;
+	case 16:
+		// Two entries of a directory with the same name.
+		if (file == 0) {
+			return -1;
+		}
+		add_entry(ROOTINO, "twice", file);
+		add_entry(ROOTINO, "twice", file);
+		inode_table[file].nlink += 2;
+		break;
+	case 17:
+		// An entry referring to an inode past the inode table, reported as
+		// check 10.
+		if (ninodes > 0xFFFF) {
+			return -1;
+		}
+		add_entry(ROOTINO, "past", ninodes);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+void usage(void) {
+	fprintf(stderr, "Usage: mkimage [--block-size N] [--size BLOCKS] [--inodes N] "
+		"[--files N] [--depth N] [--fanout N] [--mean-size BYTES] [--seed N] "
+		"[--double-indirect] [--age SWAPS] [--corrupt CHECK] <file_system_image>.\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	struct option options[] = {
+		{"block-size", required_argument, NULL, 'b'},
+		{"size", required_argument, NULL, 's'},
+		{"inodes", required_argument, NULL, 'i'},
+		{"files", required_argument, NULL, 'f'},
+		{"depth", required_argument, NULL, 'd'},
+		{"fanout", required_argument, NULL, 'F'},
+		{"mean-size", required_argument, NULL, 'm'},
+		{"seed", required_argument, NULL, 'S'},
+		{"double-indirect", no_argument, NULL, 'D'},
+		{"age", required_argument, NULL, 'a'},
+		{"corrupt", required_argument, NULL, 'c'},
+		{NULL, 0, NULL, 0}
+	};
+	int c;
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "b:s:i:f:d:F:m:S:Da:c:", options, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			bsize = strtoul(optarg, NULL, 10);
+			// The block size must be a power of two from 512 to 64 KB.
+			if (bsize < 512 || bsize > 65536 || (bsize & (bsize - 1)) != 0) {
+				usage();
+			}
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			ninodes = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			nfiles = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'F':
+			fanout = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			mean_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 10);
+			// xorshift never leaves 0.
+			if (seed == 0) {
+				seed = 1;
+			}
+			break;
+		case 'D':
+			// The last address of each inode is a double-indirect block.
+			dindirect = 1;
+			ndirect = NDIRECT_DI;
+			break;
+		case 'a':
+			swaps = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			corruption = atoi(optarg);
+			if (corruption < 1 || corruption > 17) {
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || ninodes < ROOTINO + 1 + RESERVED_INODES) {
+		usage();
+	}
+	nindirect = NINDIRECT_OF(bsize);
+	// Lay the image out like mkfs: boot block, superblock, inodes, bitmap,
+	// then data.
+	uint bitmap_block = ninodes / IPB_OF(bsize) + 3;
+	data_blocks = bitmap_block + size / BPB_OF(bsize) + 1;
+	if (data_blocks + RESERVED_BLOCKS >= size) {
+		fprintf(stderr, "image too small.\n");
+		exit(1);
+	}
+	int fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, (off_t)bsize * size) == -1) {
+		fprintf(stderr, "cannot create image.\n");
+		exit(1);
+	}
+	close(fd);
+	if (image_open(&img, argv[optind], IMAGE_WRITE) == -1) {
+		exit(1);
+	}
+	struct superblock* sb = block_ptr(1);
+	sb->size = size;
+	sb->nblocks = size - data_blocks;
+	sb->ninodes = ninodes;
+	inode_table = block_ptr(2);
+	bitmap = block_ptr(bitmap_block);
+	for (uint b = 0; b < data_blocks; b++) {
+		mark_used(b);
+	}
+	next_block = data_blocks;
+
+	make_directories();
+	make_files();
+	age_files();
+	uint used = next_block;
+	if (corruption != 0 && inject(corruption) == -1) {
+		fprintf(stderr, "cannot inject error %d.\n", corruption);
+		exit(1);
+	}
+	printf("%u inodes (%u directories, %u files), %u of %u blocks used, %llu bytes\n",
+		ndirs + made_files, ndirs, made_files, used, size,
+		(unsigned long long)bsize * size);
+
+	free(dirs);
+	free(files);
+	if (image_sync(&img) == -1 || image_close(&img) == -1) {
+		exit(1);
+	}
+	return 0;
+}
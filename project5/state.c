@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "state.h"
+
+#define STATE_MAGIC "xv6fsck"
+#define STATE_VERSION 1
+
+// Header of a state file, followed by the arrays of the state in the order
+// they are declared and checked by checksum.
+struct state_header {
+	char magic[8];
+	uint version;
+	uint bsize;
+	uint size;
+	uint nblocks;
+	uint ninodes;
+	uint dindirect;
+	uint region_inodes;
+	uint nregions;
+	uint nbitmap;
+	uint nedges;
+	uint64_t checksum;
+};
+
+/**
+ * Mix length bytes at data into hash h, eight bytes at a time.
+ */
+uint64_t state_hash(uint64_t h, const void* data, size_t length) {
+	const uchar* p = data;
+	for (; length >= 8; p += 8, length -= 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		h = (h ^ (w * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+		h ^= h >> 31;
+	}
+	if (length > 0) {
+		uint64_t w = 0;
+		memcpy(&w, p, length);
+		h = (h ^ (w * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+		h ^= h >> 31;
+	}
+	return h;
+}
+
+// The arrays of a state, with their sizes in bytes.
+struct array {
+	void** data;
+	size_t bytes;
+};
+
+/**
+ * Describe the arrays of s in file order. Return their number.
+ */
+static int state_arrays(struct state* s, struct array* arrays) {
+	arrays[0].data = (void**)&s->regions;
+	arrays[0].bytes = (size_t)s->nregions * sizeof(uint64_t);
+	arrays[1].data = (void**)&s->bitmap;
+	arrays[1].bytes = (size_t)s->nbitmap * sizeof(uint64_t);
+	arrays[2].data = (void**)&s->owner;
+	arrays[2].bytes = (size_t)s->size * sizeof(uint);
+	arrays[3].data = (void**)&s->direct;
+	arrays[3].bytes = (size_t)(s->size + 63) / 64 * sizeof(uint64_t);
+	arrays[4].data = (void**)&s->directories;
+	arrays[4].bytes = (size_t)(s->ninodes + 63) / 64 * sizeof(uint64_t);
+	arrays[5].data = (void**)&s->edges;
+	arrays[5].bytes = (size_t)s->nedges * 2 * sizeof(uint);
+	return 6;
+}
+
+/**
+ * Allocate the arrays of s for its geometry, with every block free and no
+ * directory entries. Return 0 on success. Return -1 if memory runs out.
+ */
+int state_alloc(struct state* s) {
+	struct array arrays[6];
+	s->nedges = 0;
+	int n = state_arrays(s, arrays);
+	for (int i = 0; i < n; i++) {
+		*arrays[i].data = calloc(1, arrays[i].bytes + 1);
+		if (*arrays[i].data == NULL) {
+			return -1;
+		}
+	}
+	memset(s->owner, 0xFF, (size_t)s->size * sizeof(uint));
+	return 0;
+}
+
+/**
+ * Read the state saved at path into s. Return 0 on success. Return -1 if
+ * there is no state or it is damaged, leaving s empty.
+ */
+int state_load(struct state* s, const char* path) {
+	struct state_header header;
+	memset(s, 0, sizeof(*s));
+	FILE* fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, fp) != 1 ||
+		memcmp(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0 ||
+		header.version != STATE_VERSION) {
+		fclose(fp);
+		return -1;
+	}
+	s->bsize = header.bsize;
+	s->size = header.size;
+	s->nblocks = header.nblocks;
+	s->ninodes = header.ninodes;
+	s->dindirect = header.dindirect;
+	s->region_inodes = header.region_inodes;
+	s->nregions = header.nregions;
+	s->nbitmap = header.nbitmap;
+	s->nedges = header.nedges;
+	struct array arrays[6];
+	int n = state_arrays(s, arrays);
+	uint64_t checksum = 0;
+	int i;
+	for (i = 0; i < n; i++) {
+		*arrays[i].data = malloc(arrays[i].bytes + 1);
+		if (*arrays[i].data == NULL || fread(*arrays[i].data, 1, arrays[i].bytes, fp) != arrays[i].bytes) {
+			break;
+		}
+		checksum = state_hash(checksum, *arrays[i].data, arrays[i].bytes);
+	}
+	// Anything left over means the file does not match its header.
+	int trailing = fgetc(fp) != EOF;
+	fclose(fp);
+	if (i < n || checksum != header.checksum || trailing) {
+		state_free(s);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Save s to path. The state is written to a temporary file which then
+ * replaces path, so a crash leaves either the old or the new state. Return 0
+ * on success. Return -1 if there is an error.
+ */
+int state_save(struct state* s, const char* path) {
+	struct state_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+	header.version = STATE_VERSION;
+	header.bsize = s->bsize;
+	header.size = s->size;
+	header.nblocks = s->nblocks;
+	header.ninodes = s->ninodes;
+	header.dindirect = s->dindirect;
+	header.region_inodes = s->region_inodes;
+	header.nregions = s->nregions;
+	header.nbitmap = s->nbitmap;
+	header.nedges = s->nedges;
+	struct array arrays[6];
+	int n = state_arrays(s, arrays);
+	for (int i = 0; i < n; i++) {
+		header.checksum = state_hash(header.checksum, *arrays[i].data, arrays[i].bytes);
+	}
+	size_t length = strlen(path);
+	char* temporary = malloc(length + 5);
+	if (temporary == NULL) {
+		return -1;
+	}
+	snprintf(temporary, length + 5, "%s.tmp", path);
+	FILE* fp = fopen(temporary, "wb");
+	if (fp == NULL) {
+		free(temporary);
+		return -1;
+	}
+	int error = fwrite(&header, sizeof(header), 1, fp) != 1;
+	for (int i = 0; i < n && !error; i++) {
+		error = fwrite(*arrays[i].data, 1, arrays[i].bytes, fp) != arrays[i].bytes;
+	}
+	// The new state must be on disk before it replaces the old one.
+	if (fflush(fp) != 0 || fsync(fileno(fp)) == -1) {
+		error = 1;
+	}
+	if (fclose(fp) != 0) {
+		error = 1;
+	}
+	if (error || rename(temporary, path) == -1) {
+		unlink(temporary);
+		free(temporary);
+		return -1;
+	}
+	free(temporary);
+	return 0;
+}
+
+/**
+ * Free the arrays of s.
+ */
+void state_free(struct state* s) {
+	free(s->regions);
+	free(s->bitmap);
+	free(s->owner);
+	free(s->direct);
+	free(s->directories);
+	free(s->edges);
+	memset(s, 0, sizeof(*s));
+}
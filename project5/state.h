@@ -0,0 +1,39 @@
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "types.h"
+
+// Owners of a block that is not used by exactly one inode.
+#define STATE_FREE   ((uint)-1) /* No inode uses the block. */
+#define STATE_SHARED ((uint)-2) /* More than one inode uses the block. */
+
+// What a clean check found, kept in a file so that a later check only rescans
+// the regions of the inode table that changed since. A region is a run of
+// inode blocks together with the indirect and directory blocks of its inodes.
+struct state {
+	uint bsize;             /* Geometry of the image checked. */
+	uint size;
+	uint nblocks;
+	uint ninodes;
+	uint dindirect;
+	uint region_inodes;     /* Inodes per region. */
+	uint nregions;          /* Regions of the inode table. */
+	uint nbitmap;           /* Blocks of the bitmap. */
+	uint nedges;            /* Directory entries in edges. */
+	uint64_t* regions;      /* Hash of each region. */
+	uint64_t* bitmap;       /* Hash of each bitmap block. */
+	uint* owner;            /* Inode using each block, or STATE_FREE or STATE_SHARED. */
+	uint64_t* direct;       /* Bit b is set if block b is used by a direct address. */
+	uint64_t* directories;  /* Bit i is set if inode i is a directory. */
+	uint* edges;            /* Pairs of a directory and an inode its entries refer to. */
+};
+
+uint64_t state_hash(uint64_t h, const void* data, size_t length);
+int state_alloc(struct state* s);
+int state_load(struct state* s, const char* path);
+int state_save(struct state* s, const char* path);
+void state_free(struct state* s);
+
+#endif // _STATE_H_
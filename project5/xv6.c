@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stat.h"
+#include "xv6.h"
+
+/**
+ * Copy length bytes at offset of the image into buf. Return 0 on success.
+ * Return -1 if there is an error.
+ */
+static int copy(struct xv6* fs, void* buf, uint64_t offset, size_t length) {
+	if (offset + length > fs->img.bytes) {
+		return -1;
+	}
+	if (fs->img.map != NULL) {
+		memcpy(buf, fs->img.map + offset, length);
+		return 0;
+	}
+	if (!(fs->img.flags & IMAGE_DIRECT)) {
+		return image_read(&fs->img, buf, offset, length);
+	}
+	// O_DIRECT reads whole aligned blocks into an aligned buffer.
+	uint64_t start = offset / IMAGE_ALIGN * IMAGE_ALIGN;
+	uint64_t end = (offset + length + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+	uchar* aligned = image_buffer(end - start);
+	int result = image_read(&fs->img, aligned, start, end - start);
+	if (result == 0) {
+		memcpy(buf, aligned + (offset - start), length);
+	}
+	free(aligned);
+	return result;
+}
+
+/**
+ * Return 1 if addr is a block of the image, 0 otherwise.
+ */
+static int valid_addr(struct xv6* fs, uint addr) {
+	return addr != 0 && addr < fs->sb.size;
+}
+
+/**
+ * Return the first block of the bitmap of an image with block size bs
+ * described by super. The inode blocks follow the superblock, then the bitmap
+ * blocks, and each area has one block more than it needs, as made by mkfs.
+ */
+static uint64_t bitmap_start(uint bs, struct superblock* super) {
+	return super->ninodes / IPB_OF(bs) + 3;
+}
+
+/**
+ * Return the first data block of an image with block size bs described by
+ * super.
+ */
+static uint64_t data_start(uint bs, struct superblock* super) {
+	return bitmap_start(bs, super) + super->size / BPB_OF(bs) + 1;
+}
+
+/**
+ * Return 1 if super is a plausible superblock for block size bs. Return 0
+ * otherwise.
+ */
+static int valid_superblock(struct xv6* fs, uint bs, struct superblock* super) {
+	return super->ninodes > ROOTINO && super->size > 0 && super->nblocks <= super->size &&
+		(uint64_t)super->size * bs <= fs->img.bytes && data_start(bs, super) < super->size;
+}
+
+/**
+ * Open the image at path. Unless the block size is given, try each power of
+ * two from 512 to 64 KB and prefer the one whose superblock matches the image
+ * size exactly. Return 0 on success. Return -1 if there is an error, with a
+ * message printed.
+ */
+int xv6_open(struct xv6* fs, const char* path, uint bsize, int flags) {
+	memset(fs, 0, sizeof(*fs));
+	int image_flags = ((flags & XV6_STREAM) ? IMAGE_STREAM : 0) |
+		((flags & XV6_WRITE) ? IMAGE_WRITE : 0) | ((flags & XV6_PRIVATE) ? IMAGE_PRIVATE : 0) |
+		((flags & XV6_DIRECT) ? IMAGE_STREAM | IMAGE_DIRECT : 0);
+	if (image_open(&fs->img, path, image_flags) == -1) {
+		return -1;
+	}
+	for (uint bs = 512; bs <= 65536; bs *= 2) {
+		struct superblock candidate;
+		if ((bsize != 0 && bs != bsize) || copy(fs, &candidate, bs, sizeof(candidate)) == -1 ||
+			!valid_superblock(fs, bs, &candidate)) {
+			continue;
+		}
+		if (fs->bsize == 0 || (uint64_t)candidate.size * bs == fs->img.bytes) {
+			fs->bsize = bs;
+			fs->sb = candidate;
+		}
+		if ((uint64_t)candidate.size * bs == fs->img.bytes) {
+			break;
+		}
+	}
+	if (fs->bsize == 0) {
+		fprintf(stderr, "ERROR: bad superblock.\n");
+		image_close(&fs->img);
+		return -1;
+	}
+	fs->bitmap_start = bitmap_start(fs->bsize, &fs->sb);
+	fs->data_start = data_start(fs->bsize, &fs->sb);
+	fs->dindirect = (flags & XV6_DINDIRECT) != 0;
+	fs->ndirect = fs->dindirect ? NDIRECT_DI : NDIRECT;
+	fs->nindirect = NINDIRECT_OF(fs->bsize);
+	return 0;
+}
+
+/**
+ * Read inode inum into dip. Return 0 on success. Return -1 if there is no
+ * such inode.
+ */
+int xv6_inode(struct xv6* fs, uint inum, struct dinode* dip) {
+	if (inum >= fs->sb.ninodes) {
+		return -1;
+	}
+	return copy(fs, dip, (uint64_t)fs->bsize * 2 + (uint64_t)inum * sizeof(struct dinode),
+		sizeof(struct dinode));
+}
+
+/**
+ * Return the addresses in indirect block addr. A mapped image is read in
+ * place; otherwise the block is decoded into the least recently used slot of
+ * the cache unless it is there already. Return NULL if the block cannot be
+ * read.
+ */
+static uint* indirect_block(struct xv6* fs, uint addr) {
+	if (fs->img.map != NULL) {
+		return (uint*)(fs->img.map + (uint64_t)fs->bsize * addr);
+	}
+	struct xv6_cached* victim = &fs->cache[0];
+	fs->clock++;
+	for (int i = 0; i < XV6_CACHE; i++) {
+		struct xv6_cached* c = &fs->cache[i];
+		if (c->addr == addr) {
+			c->used = fs->clock;
+			return c->data;
+		}
+		if (c->used < victim->used) {
+			victim = c;
+		}
+	}
+	if (victim->data == NULL && (victim->data = malloc(fs->bsize)) == NULL) {
+		return NULL;
+	}
+	if (copy(fs, victim->data, (uint64_t)fs->bsize * addr, fs->bsize) == -1) {
+		victim->addr = 0;
+		return NULL;
+	}
+	victim->addr = addr;
+	victim->used = fs->clock;
+	return victim->data;
+}
+
+/**
+ * Return the address of the n-th block of the file dip, or 0 if it has no
+ * such block or the address is out of the image.
+ */
+uint xv6_bmap(struct xv6* fs, const struct dinode* dip, uint n) {
+	uint addr = 0;
+	if (n < fs->ndirect) {
+		addr = dip->addrs[n];
+	}
+	else if ((n -= fs->ndirect) < fs->nindirect) {
+		uint* indirect;
+		if (valid_addr(fs, dip->addrs[fs->ndirect]) &&
+			(indirect = indirect_block(fs, dip->addrs[fs->ndirect])) != NULL) {
+			addr = indirect[n];
+		}
+	}
+	else if (fs->dindirect && (n -= fs->nindirect) / fs->nindirect < fs->nindirect) {
+		uint* dind;
+		uint* indirect;
+		if (valid_addr(fs, dip->addrs[fs->ndirect + 1]) &&
+			(dind = indirect_block(fs, dip->addrs[fs->ndirect + 1])) != NULL &&
+			valid_addr(fs, dind[n / fs->nindirect]) &&
+			(indirect = indirect_block(fs, dind[n / fs->nindirect])) != NULL) {
+			addr = indirect[n % fs->nindirect];
+		}
+	}
+	return valid_addr(fs, addr) ? addr : 0;
+}
+
+/**
+ * Read up to length bytes of file dip at offset into buf. Consecutive blocks
+ * that are also consecutive in the image are copied with one read. Holes
+ * read as zeros. Return the number of bytes read, 0 at the end of the file.
+ * Return -1 if there is an error.
+ */
+ssize_t xv6_read(struct xv6* fs, const struct dinode* dip, void* buf, uint64_t offset, size_t length) {
+	if (offset >= dip->size) {
+		return 0;
+	}
+	if (length > dip->size - offset) {
+		length = dip->size - offset;
+	}
+	uchar* out = buf;
+	size_t done = 0;
+	while (done < length) {
+		uint n = (offset + done) / fs->bsize;
+		uint skip = (offset + done) % fs->bsize;
+		uint addr = xv6_bmap(fs, dip, n);
+		// Extend the run while the next block follows this one on disk.
+		uint64_t run = fs->bsize - skip;
+		while (addr != 0 && done + run < length && xv6_bmap(fs, dip, n + 1) == addr + (run + skip) / fs->bsize) {
+			run += fs->bsize;
+			n++;
+		}
+		if (run > length - done) {
+			run = length - done;
+		}
+		if (addr == 0) {
+			memset(out + done, 0, run);
+		}
+		else if (copy(fs, out + done, (uint64_t)fs->bsize * addr + skip, run) == -1) {
+			return -1;
+		}
+		done += run;
+	}
+	return done;
+}
+
+/**
+ * Call visit with each entry in use of directory inum, in order, until it
+ * returns nonzero. Return 0 on success, or what visit returned if it stopped
+ * early. Return -1 if inum is not a directory or cannot be read.
+ */
+int xv6_readdir(struct xv6* fs, uint inum, int (*visit)(void* arg, const struct dirent* entry), void* arg) {
+	struct dinode dip;
+	if (xv6_inode(fs, inum, &dip) == -1 || dip.type != T_DIR) {
+		return -1;
+	}
+	struct dirent* entries = malloc(fs->bsize);
+	if (entries == NULL) {
+		return -1;
+	}
+	uint per_block = fs->bsize / sizeof(struct dirent);
+	int result = 0;
+	for (uint64_t offset = 0; offset < dip.size && result == 0; offset += fs->bsize) {
+		ssize_t n = xv6_read(fs, &dip, entries, offset, fs->bsize);
+		if (n < 0) {
+			result = -1;
+			break;
+		}
+		for (uint k = 0; k < per_block && k < n / sizeof(struct dirent) && result == 0; k++) {
+			if (entries[k].inum != 0) {
+				result = visit(arg, &entries[k]);
+			}
+		}
+	}
+	free(entries);
+	return result;
+}
+
+// A name looked up by xv6_lookup().
+struct wanted {
+	const char* name;
+	size_t length;
+	uint inum;
+};
+
+/**
+ * Stop at the entry named as wanted.
+ */
+static int match(void* arg, const struct dirent* entry) {
+	struct wanted* w = arg;
+	if (strncmp(entry->name, w->name, w->length) == 0 &&
+		(w->length == DIRSIZ || entry->name[w->length] == '\0')) {
+		w->inum = entry->inum;
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Return the inode named by path from the root, or 0 if there is none.
+ */
+uint xv6_lookup(struct xv6* fs, const char* path) {
+	uint inum = ROOTINO;
+	while (*path != '\0') {
+		if (*path == '/') {
+			path++;
+			continue;
+		}
+		struct wanted w = {path, strcspn(path, "/"), 0};
+		if (w.length > DIRSIZ || xv6_readdir(fs, inum, match, &w) != 1) {
+			return 0;
+		}
+		inum = w.inum;
+		path += w.length;
+	}
+	return inum < fs->sb.ninodes ? inum : 0;
+}
+
+/**
+ * Close the image and free the cache. Return 0 on success. Return -1 if
+ * there is an error, with a message printed.
+ */
+int xv6_close(struct xv6* fs) {
+	for (int i = 0; i < XV6_CACHE; i++) {
+		free(fs->cache[i].data);
+	}
+	return image_close(&fs->img);
+}
@@ -0,0 +1,52 @@
+#ifndef _XV6_H_
+#define _XV6_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "types.h"
+#include "fs.h"
+#include "image.h"
+
+// Ways to open an image with xv6_open().
+#define XV6_STREAM    1 /* Read it with pread() instead of mapping it. */
+#define XV6_DINDIRECT 2 /* Its inodes have a double-indirect pointer. */
+#define XV6_WRITE     4 /* Map it shared and writable. */
+#define XV6_PRIVATE   8 /* Map it private and writable; writes are discarded. */
+#define XV6_DIRECT   16 /* Stream it with O_DIRECT, bypassing the page cache. */
+
+// Indirect blocks a reader keeps decoded.
+#define XV6_CACHE 16
+
+// An indirect block kept by a reader.
+struct xv6_cached {
+	uint addr;      /* Block number, 0 if the slot is empty. */
+	uint64_t used;  /* Clock of the last use. */
+	uint* data;     /* The addresses in the block. */
+};
+
+// A view of an xv6 image, read-only unless opened with XV6_WRITE or
+// XV6_PRIVATE. A reader is used by one thread at a time; threads that read the
+// same image open a reader each. Indirect blocks of a mapped image are read in
+// place, so they are never stale after a write.
+struct xv6 {
+	struct image img;                    /* The image. */
+	struct superblock sb;                /* Copy of the superblock. */
+	uint bsize;                          /* Block size in bytes. */
+	uint bitmap_start;                   /* First block of the bitmap. */
+	uint data_start;                     /* First data block. */
+	uint ndirect;                        /* Direct pointers in an inode. */
+	uint nindirect;                      /* Addresses in an indirect block. */
+	int dindirect;                       /* Inodes have a double-indirect pointer. */
+	struct xv6_cached cache[XV6_CACHE];  /* Least recently used indirect blocks. */
+	uint64_t clock;                      /* Number of uses of the cache. */
+};
+
+int xv6_open(struct xv6* fs, const char* path, uint bsize, int flags);
+int xv6_inode(struct xv6* fs, uint inum, struct dinode* dip);
+uint xv6_bmap(struct xv6* fs, const struct dinode* dip, uint n);
+ssize_t xv6_read(struct xv6* fs, const struct dinode* dip, void* buf, uint64_t offset, size_t length);
+int xv6_readdir(struct xv6* fs, uint inum, int (*visit)(void* arg, const struct dirent* entry), void* arg);
+uint xv6_lookup(struct xv6* fs, const char* path);
+int xv6_close(struct xv6* fs);
+
+#endif // _XV6_H_
@@ -3,176 +3,1720 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
 #include <string.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include "fs.h"
 #include "stat.h"
 #include "types.h"
+#include "bitmap.h"
+#include "image.h"
+#include "state.h"
+#include "dirindex.h"
+#include "xv6.h"
 
+struct xv6 fs;                     /* The file system image and its geometry. */
 void* img_ptr = NULL;              /* Starting address of the first block of file system image. */
 struct superblock* sb = NULL;      /* Starting address of the superblock. */
+struct superblock super;           /* Copy of the superblock. */
+uint bsize = 0;                    /* Block size in bytes, detected if 0. */
+uint nindirect;                    /* Number of addresses in an indirect block. */
+int dindirect = 0;                 /* Inodes have a double-indirect pointer. */
+uint ndirect = NDIRECT;            /* Number of direct pointers in an inode. */
 struct dinode* inode_table = NULL; /* Starting address of inode table. */
 uchar* bitmap = NULL;              /* Starting address of bitmap. */
 uint data_blocks;                  /* Starting address of data blocks in blocks. */
 uint size;                         /* Size of file system image in blocks. */
 uint nblocks;                      /* Number of data blocks. */
 uint ninodes;                      /* Number of inodes. */
-int* blocks_used;                  /* Number of times each block is used */
+uint64_t* blocks_used;             /* Bit b is set if data block b is in use. */
+uint64_t* blocks_direct;           /* Bit b is set if a direct pointer is the only use of block b. */
+ushort* count;                     /* Number of directory entries referring to each inode. */
+uint64_t* in_use;                  /* Bit i is set if inode i is in use. */
+uint64_t* directories;             /* Bit i is set if inode i is a directory. */
+uint64_t* visited;                 /* Bit i is set if inode i was reached from the root. */
+uint64_t* on_path;                 /* Bit i is set while directory i is being walked. */
+uint failed;                       /* Bit i is set if check i found an error. */
+int report_all = 0;                /* Collect every violation instead of the first. */
+int json = 0;                      /* Print collected violations as JSON. */
+uint max_errors = 1000;            /* Stop collecting after this many violations. */
+struct violation* violations;      /* Violations collected in report-all mode. */
+uint nviolations;                  /* Number of collected violations. */
+int truncated = 0;                 /* The error cap was reached. */
+int repair = 0;                    /* Fix the errors that can be fixed. */
+int dry_run = 0;                   /* Print repairs without writing them. */
+int stream = 0;                    /* Read the image instead of mapping it. */
+int direct_io = 0;                 /* Stream with O_DIRECT. */
+size_t memory = 64 << 20;          /* Bytes of image data held in memory when streaming. */
+struct dinode* inode_buffer;       /* Inodes read while streaming. */
+uint chunk_inodes;                 /* Number of inodes read at a time while streaming. */
+uchar* window;                     /* Blocks read while streaming. */
+size_t window_bytes;               /* Size of window. */
+struct pending* pending;           /* Blocks waiting to be read. */
+uint npending;                     /* Number of entries in pending. */
+uint pending_capacity;             /* Allocated entries in pending. */
+uint max_pending;                  /* Read the pending blocks once there are this many. */
+char* state_path = NULL;           /* File keeping the state of the last clean check. */
+struct state state;                /* State of the last clean check, updated by this one. */
+uint edge_capacity;                /* Allocated pairs in state.edges. */
+int hashed = 0;                    /* The hashes in state are those of this image. */
+int rescan_bitmap = 1;             /* Compare the bitmap with the blocks in use. */
+int rescan_references = 1;         /* Check conditions 9 ~ 12. */
+int rescan_tree = 1;               /* Walk the directory tree. */
+int incremental = 0;               /* Only the inodes changed since the state were checked. */
+int stats = 0;                     /* Print where the time went on exit. */
+int phase = -1;                    /* Phase being timed, -1 before the first. */
+struct timespec phase_time;        /* When the current phase started. */
+struct rusage phase_usage;         /* Resource usage when it started. */
+struct timespec start_time;        /* When the check started. */
+uint64_t block_pairs;              /* Consecutive block pairs of files seen. */
+uint64_t discontiguous;            /* Those not adjacent on disk. */
+int fragmentation = 0;             /* Analyse how files are laid out. */
+uint* extents;                     /* Runs of adjacent blocks in each inode's data. */
+struct segment* segments;          /* Ends of the parts of files with indirect blocks. */
+uint nsegments;                    /* Number of entries in segments. */
+uint segment_capacity;             /* Allocated entries in segments. */
+struct owned* marked_free;         /* Blocks in use but marked free, with their inodes. */
+uint nmarked_free;                 /* Number of entries in marked_free. */
+uint marked_free_capacity;         /* Allocated entries in marked_free. */
+
+// A block in use by inode inum.
+struct owned {
+	uint block;
+	uint inum;
+};
+
+// A block whose contents a check needs. Pending blocks are read after the
+// inodes that refer to them, in block order.
+struct pending {
+	uint block;  /* Block to read. */
+	uint inum;   /* Inode the block belongs to. */
+	short type;  /* Type of that inode. */
+	ushort kind; /* What to do with the block. */
+	uint index;  /* Which of the inode's indirect blocks it is, see struct segment. */
+};
+
+// The first and last data block of one part of a file: its direct blocks
+// (index 0), its indirect block (1) or the k-th indirect block under its
+// double-indirect block (2 + k). Parts are read in block order, so whether an
+// extent runs on from one part into the next is decided after the pass.
+struct segment {
+	uint inum;
+	uint index;
+	uint block;  /* The indirect block holding the part, 0 for direct blocks. */
+	uint first;
+	uint last;
+};
+
+// Inode blocks per region of the state file.
+#define REGION_BLOCKS 8
+
+// Kinds of pending blocks.
+#define PENDING_INDIRECT  0 /* Indirect block: check the addresses in it. */
+#define PENDING_DIRECTORY 1 /* Directory block: count its entries. */
+#define PENDING_FIRST     2 /* First directory block: check its format, then count. */
+#define PENDING_DINDIRECT 3 /* Double-indirect block: check the indirect blocks in it. */
+
+// Blocks read while streaming are coalesced into one read when they are at
+// most this many bytes apart.
+#define RUN_GAP (32 << 10)
+
+// Blocks from first to first + n - 1, read into data when streaming.
+struct run {
+	uint first;
+	uint n;
+	uchar* data;
+};
+
+// Reference counts saturate at this value.
+#define COUNT_MAX 0xFFFF
+
+// Field of a violation that does not apply to it.
+#define NONE ((uint)-1)
+
+// Checks in the order their errors are reported. Conditions 1 ~ 8 are checked
+// during the pass over the inode table, conditions 9 ~ 12 afterwards, and
+// conditions 13 ~ 16 by the walk of the directory tree.
+enum check {
+	CHECK_INODE_TYPE,
+	CHECK_DIRECTORY_FORMAT,
+	CHECK_ROOT,
+	CHECK_DIRECT_ADDR,
+	CHECK_INDIRECT_ADDR,
+	CHECK_DIRECT_ONCE,
+	CHECK_ADDRESS_BITMAP,
+	CHECK_MARKED_USED,
+	CHECK_INODE_UNREFERENCED,
+	CHECK_INODE_REFERRED_FREE,
+	CHECK_DIRECTORY_LINKED_TWICE,
+	CHECK_REFERENCE_COUNT,
+	CHECK_PARENT,
+	CHECK_DIRECTORY_CYCLE,
+	CHECK_UNREACHABLE,
+	CHECK_DUPLICATE_NAME,
+	NCHECKS
+};
+
+// Phases of a check, timed separately by --stats. The checks are fused, so
+// time is accounted to the phase that does the work rather than to a check.
+enum phase {
+	PHASE_STATE,
+	PHASE_INODES,
+	PHASE_BLOCKS,
+	PHASE_BITMAP,
+	PHASE_REFERENCES,
+	PHASE_TREE,
+	NPHASES
+};
+
+const char* phase_names[NPHASES] = {
+	"state",
+	"inodes",
+	"blocks",
+	"bitmap",
+	"references",
+	"tree"
+};
+
+// The checks each phase performs.
+const char* phase_checks[NPHASES] = {
+	"",
+	"inode_type,root_check,direct_addr,indirect_addr,direct_once,address_count",
+	"directory_format,root_check,indirect_addr,direct_once,address_count",
+	"address_bitmap,marked_used",
+	"inode_unreferenced,inode_referred_free,directory_linked_twice,reference_count",
+	"parent,directory_cycle,unreachable,duplicate_name"
+};
+
+// What one phase cost: time, page faults and how much of the image it went
+// through.
+struct phase_stats {
+	double seconds;
+	long minor_faults;
+	long major_faults;
+	uint64_t items;  /* Inodes, blocks or words visited. */
+	uint64_t bytes;  /* Bytes of image and bookkeeping touched. */
+};
+
+struct phase_stats phases[NPHASES];
+
+// Failed checks after which the shape of the directory tree cannot be trusted.
+#define STRUCTURAL ((1 << CHECK_INODE_TYPE) | (1 << CHECK_DIRECTORY_FORMAT) | \
+	(1 << CHECK_ROOT) | (1 << CHECK_DIRECTORY_LINKED_TWICE))
+
+// One inconsistency found in the image. inum is the inode holding the bad
+// data, block the block involved and entry either the directory entry in that
+// block or the index of the pointer in the inode or indirect block. Bitmap
+// errors cover the run of blocks from block to last.
+struct violation {
+	uint check;
+	uint inum;
+	uint block;
+	uint entry;
+	uint last;
+};
+
+const char* check_names[NCHECKS] = {
+	"inode_type",
+	"directory_format",
+	"root_check",
+	"direct_addr",
+	"indirect_addr",
+	"direct_once",
+	"address_bitmap",
+	"marked_used",
+	"inode_unreferenced",
+	"inode_referred_free",
+	"directory_linked_twice",
+	"reference_count",
+	"parent",
+	"directory_cycle",
+	"unreachable",
+	"duplicate_name"
+};
+
+const char* check_errors[NCHECKS] = {
+	"ERROR: bad inode.",
+	"ERROR: directory not properly formatted.",
+	"ERROR: root directory does not exist.",
+	"ERROR: bad direct address in inode.",
+	"ERROR: bad indirect address in inode.",
+	"ERROR: direct address used more than once.",
+	"ERROR: address used by inode but marked free in bitmap.",
+	"ERROR: bitmap marks block in use but it is not in use.",
+	"ERROR: inode marked use but not found in a directory.",
+	"ERROR: inode referred to in directory but marked free.",
+	"ERROR: directory appears more than once in file system.",
+	"ERROR: bad reference count for file.",
+	"ERROR: parent directory mismatch.",
+	"ERROR: directory cycle.",
+	"ERROR: inode not reachable from root directory.",
+	"ERROR: duplicate name in directory."
+};
+
+/**
+ * Return p, memory just allocated, or exit with a message if the allocation
+ * failed.
+ */
+void* allocated(void* p) {
+	if (p == NULL) {
+		fprintf(stderr, "malloc() failed.\n");
+		exit(1);
+	}
+	return p;
+}
+
+/**
+ * Record that check found an error. In report-all mode the violation is also
+ * kept for printing, until max_errors violations have been collected.
+ */
+void report(uint check, uint inum, uint block, uint entry) {
+	failed |= 1 << check;
+	if (!report_all) {
+		return;
+	}
+	if (nviolations == max_errors) {
+		truncated = 1;
+		return;
+	}
+	// Grow the array by doubling.
+	if ((nviolations & (nviolations - 1)) == 0) {
+		uint capacity = nviolations == 0 ? 16 : nviolations * 2;
+		violations = allocated(realloc(violations, sizeof(struct violation) * capacity));
+	}
+	struct violation* v = &violations[nviolations++];
+	v->check = check;
+	v->inum = inum;
+	v->block = block;
+	v->entry = entry;
+	v->last = NONE;
+}
+
+/**
+ * Record that check found an error in every block from block to last, all of
+ * them in inode inum.
+ */
+void report_range(uint check, uint inum, uint block, uint last) {
+	uint n = nviolations;
+	report(check, inum, block, NONE);
+	if (nviolations != n && last != block) {
+		violations[n].last = last;
+	}
+}
+
+/**
+ * Print one line of the repair diff.
+ */
+void repaired(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	printf("%s", dry_run ? "would repair: " : "repair: ");
+	vprintf(format, args);
+	printf("\n");
+	va_end(args);
+}
+
+/**
+ * Return the address of block addr in the mapped image.
+ */
+void* block_ptr(uint addr) {
+	return (uchar*)img_ptr + (uint64_t)bsize * addr;
+}
+
+/**
+ * Return 1 if addr is the address of a data block. Return 0 otherwise.
+ */
+int valid_addr(uint addr) {
+	return (addr >= data_blocks) && (addr < size);
+}
+
+/**
+ * Return bit b of the bit set.
+ */
+int test_bit(uint64_t* set, uint b) {
+	return (set[b / 64] >> (b % 64)) & 1;
+}
+
+/**
+ * Set bit b of the bit set.
+ */
+void set_bit(uint64_t* set, uint b) {
+	set[b / 64] |= (uint64_t)1 << (b % 64);
+}
+
+/**
+ * Clear bit b of the bit set.
+ */
+void clear_bit(uint64_t* set, uint b) {
+	set[b / 64] &= ~((uint64_t)1 << (b % 64));
+}
+
+/**
+ * Return the w-th 64-bit word of the on-disk bitmap, which holds the bits of
+ * blocks 64 * w to 64 * w + 63 in the same order as blocks_used.
+ */
+uint64_t bitmap_word(uint w) {
+	uint64_t word;
+	memcpy(&word, bitmap + w * 8, sizeof(word));
+	return word;
+}
+
+/**
+ * Return the mask of the bits of word w that belong to blocks from to to - 1.
+ */
+uint64_t block_mask(uint w, uint from, uint to) {
+	uint64_t mask = ~(uint64_t)0;
+	if (from > w * 64) {
+		mask = from - w * 64 >= 64 ? 0 : mask << (from - w * 64);
+	}
+	if (to < w * 64 + 64) {
+		mask &= to <= w * 64 ? 0 : ~(uint64_t)0 >> (w * 64 + 64 - to);
+	}
+	return mask;
+}
+
+/**
+ * Return the mask of the bits of word w that belong to data blocks.
+ */
+uint64_t data_mask(uint w) {
+	return block_mask(w, data_blocks, size);
+}
+
+/**
+ * Return the seconds from a to b.
+ */
+double elapsed(struct timespec* a, struct timespec* b) {
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/**
+ * Charge the time and faults since the last switch to the current phase and
+ * make p the current phase. Return the phase that was current.
+ */
+int enter_phase(int p) {
+	int previous = phase;
+	if (!stats) {
+		return previous;
+	}
+	struct timespec now;
+	struct rusage usage;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &usage);
+	if (phase != -1) {
+		phases[phase].seconds += elapsed(&phase_time, &now);
+		phases[phase].minor_faults += usage.ru_minflt - phase_usage.ru_minflt;
+		phases[phase].major_faults += usage.ru_majflt - phase_usage.ru_majflt;
+	}
+	phase = p;
+	phase_time = now;
+	phase_usage = usage;
+	return previous;
+}
+
+/**
+ * Count items visited and bytes touched by the current phase.
+ */
+static inline void touch(uint64_t items, uint64_t bytes) {
+	if (phase != -1) {
+		phases[phase].items += items;
+		phases[phase].bytes += bytes;
+	}
+}
+
+/**
+ * Print the cost of each phase and a summary of the image to stderr. Called
+ * on exit, so it also runs when the check stops at the first error.
+ */
+void print_stats() {
+	if (!stats) {
+		return;
+	}
+	enter_phase(-1);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int p = 0; p < NPHASES; p++) {
+		if (phases[p].items == 0) {
+			continue;
+		}
+		fprintf(stderr, "stats: phase=%s time=%.3fms items=%llu bytes=%llu "
+			"minor_faults=%ld major_faults=%ld checks=%s\n", phase_names[p],
+			phases[p].seconds * 1e3, (unsigned long long)phases[p].items,
+			(unsigned long long)phases[p].bytes, phases[p].minor_faults,
+			phases[p].major_faults, phase_checks[p][0] != '\0' ? phase_checks[p] : "-");
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	fprintf(stderr, "stats: total time=%.3fms minor_faults=%ld major_faults=%ld max_rss=%ldKB\n",
+		elapsed(&start_time, &now) * 1e3, usage.ru_minflt, usage.ru_majflt, usage.ru_maxrss);
+	if (in_use == NULL) {
+		return;
+	}
+	// The bit sets cover every inode and block, also in incremental mode. The
+	// data blocks are counted from the layout, not taken from the superblock.
+	uint64_t used_inodes = 0, dirs = 0, used_blocks = 0;
+	for (uint w = 0; w < (ninodes + 63) / 64; w++) {
+		used_inodes += __builtin_popcountll(in_use[w]);
+		dirs += __builtin_popcountll(directories[w]);
+	}
+	for (uint w = 0; w < (size + 63) / 64; w++) {
+		used_blocks += __builtin_popcountll(blocks_used[w] & data_mask(w));
+	}
+	fprintf(stderr, "image: block_size=%u blocks=%u data_blocks=%u used_blocks=%llu "
+		"inodes=%u used_inodes=%llu directories=%llu files=%llu\n", bsize, size, size - data_blocks,
+		(unsigned long long)used_blocks, ninodes, (unsigned long long)used_inodes,
+		(unsigned long long)dirs, (unsigned long long)(used_inodes - dirs));
+	// Block pairs are counted by the pass over the inode table, so an
+	// incremental check, which sees only the changed inodes, has none.
+	if (incremental) {
+		fprintf(stderr, "image: block_pairs=- discontiguous=- fragmentation=-\n");
+	}
+	else {
+		fprintf(stderr, "image: block_pairs=%llu discontiguous=%llu fragmentation=%.2f%%\n",
+			(unsigned long long)block_pairs, (unsigned long long)discontiguous,
+			block_pairs == 0 ? 0.0 : 100.0 * discontiguous / block_pairs);
+	}
+	// Print once, before the bit sets are freed.
+	stats = 0;
+}
+
+/**
+ * Return 1 if block addr is marked in use in the bitmap. Return 0 otherwise.
+ */
+int bitmap_used(uint addr) {
+	return (bitmap[addr / 8] >> (addr % 8)) & 1;
+}
+
+/**
+ * Check the type of an inode. Each inode is either unallocated or one of the
+ * valid types. Return 0 if the type is valid. Return -1 if there is an error.
+ */
+int inode_type(struct dinode* dip) {
+	short type = dip->type;
+	if ((type != 0) && (type != T_FILE) && (type != T_DIR) && (type != T_DEV)) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Check the first block of the root directory, whose entries start at
+ * directory_entry. Return 0 if the root directory is consistent. Return -1 if
+ * there is an error, with the offending directory entry stored in entry.
+ */
+int root_check(struct dirent* directory_entry, uint* entry) {
+	// The parent of the root directory is itself.
+	for (uint k = 0; k < 2; k++) {
+		if (directory_entry[k].inum != ROOTINO) {
+			*entry = k;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Perform integrity checks on the first block of directory inum, whose entries
+ * start at directory_entry, making sure that "." and ".." are the first
+ * entries. The "." entry points to itself. Return 0 if the format of the
+ * directory is correct. Return -1 if there is an error, with the offending
+ * directory entry stored in entry.
+ */
+int directory_format(uint inum, struct dirent* directory_entry, uint* entry) {
+	if (!((strcmp(directory_entry[0].name, ".") == 0) &&
+		(directory_entry[0].inum == inum))) {
+		*entry = 0;
+		return -1;
+	}
+	if (strcmp(directory_entry[1].name, "..") != 0) {
+		*entry = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Record that block addr, marked free in the bitmap, is in use by inode inum.
+ */
+void add_marked_free(uint addr, uint inum) {
+	if (nmarked_free == marked_free_capacity) {
+		marked_free_capacity = marked_free_capacity == 0 ? 64 : marked_free_capacity * 2;
+		marked_free = allocated(realloc(marked_free, sizeof(struct owned) * marked_free_capacity));
+	}
+	marked_free[nmarked_free].block = addr;
+	marked_free[nmarked_free].inum = inum;
+	nmarked_free++;
+}
+
+/**
+ * Record one more reference to data block addr. direct is nonzero if the
+ * reference comes from a direct pointer. A block that is referenced from a
+ * direct pointer must not be referenced anywhere else.
+ */
+void use_block(uint inum, uint addr, int direct) {
+	if (state.owner != NULL) {
+		uint owner = state.owner[addr];
+		state.owner[addr] = owner == STATE_FREE || owner == inum ? inum : STATE_SHARED;
+	}
+	if (!test_bit(blocks_used, addr)) {
+		set_bit(blocks_used, addr);
+		if (direct) {
+			set_bit(blocks_direct, addr);
+		}
+		// Remember who uses a block marked free, for bitmap_check() to name.
+		if (report_all && !((bitmap[addr / 8] >> (addr % 8)) & 1)) {
+			add_marked_free(addr, inum);
+		}
+		return;
+	}
+	if (direct || test_bit(blocks_direct, addr)) {
+		report(CHECK_DIRECT_ONCE, inum, addr, NONE);
+	}
+	// Any further direct reference is a duplicate.
+	clear_bit(blocks_direct, addr);
+}
+
+/**
+ * Record that an entry of directory dir refers to inode inum in the state.
+ */
+void add_edge(uint dir, uint inum) {
+	if (state.nedges == edge_capacity) {
+		edge_capacity = edge_capacity == 0 ? 1024 : edge_capacity * 2;
+		state.edges = allocated(realloc(state.edges, sizeof(uint) * 2 * edge_capacity));
+	}
+	state.edges[2 * state.nedges] = dir;
+	state.edges[2 * state.nedges + 1] = inum;
+	state.nedges++;
+}
+
+/**
+ * Count the references to each inode in the directory entries stored in data
+ * block addr of directory dir, starting from entry start. Entries that refer to
+ * nonexistent inodes are reported, and when repairing, those and the entries
+ * that refer to free inodes are cleared. bs is the block size, a
+ * constant in the specialised copies made by count_entries().
+ */
+static inline __attribute__((always_inline))
+void count_entries_bs(uint bs, uint dir, uint addr, struct dirent* directory_entry, uint start) {
+	// Number of directory entries can be contained in a data block.
+	uint num = bs / (sizeof(struct dirent));
+	for (uint k = start; k < num; k++) {
+		uint inum = directory_entry[k].inum;
+		if (inum == 0) {
+			continue;
+		}
+		// An inode past the table has no count to catch it later, so it is
+		// reported here in every mode.
+		if (inum >= ninodes || (repair && inode_table[inum].type == 0)) {
+			report(CHECK_INODE_REFERRED_FREE, inum, addr, k);
+			if (repair) {
+				repaired("block %u: clear entry %u referring to free inode %u", addr, k, inum);
+				directory_entry[k].inum = 0;
+			}
+			continue;
+		}
+		if (count[inum] != COUNT_MAX) {
+			count[inum]++;
+		}
+		if (state_path != NULL) {
+			add_edge(dir, inum);
+		}
+	}
+}
+
+/**
+ * Count the references in a directory block, using a copy of the loop
+ * compiled for the common block sizes.
+ */
+void count_entries(uint dir, uint addr, struct dirent* directory_entry, uint start) {
+	switch (bsize) {
+	case 512:
+		count_entries_bs(512, dir, addr, directory_entry, start);
+		break;
+	case 4096:
+		count_entries_bs(4096, dir, addr, directory_entry, start);
+		break;
+	default:
+		count_entries_bs(bsize, dir, addr, directory_entry, start);
+	}
+}
+
+/**
+ * Record the first and last data blocks of part index of inode inum, whose
+ * addresses are in indirect block block.
+ */
+void add_segment(uint inum, uint index, uint block, uint first, uint last) {
+	if (nsegments == segment_capacity) {
+		segment_capacity = segment_capacity == 0 ? 1024 : segment_capacity * 2;
+		segments = allocated(realloc(segments, sizeof(struct segment) * segment_capacity));
+	}
+	segments[nsegments].inum = inum;
+	segments[nsegments].index = index;
+	segments[nsegments].block = block;
+	segments[nsegments].first = first;
+	segments[nsegments].last = last;
+	nsegments++;
+}
+
+/**
+ * Queue block for reading on behalf of inode inum of the given type. index is
+ * the position of an indirect block among the inode's.
+ */
+void defer(uint block, uint inum, short type, ushort kind, uint index) {
+	if (npending == pending_capacity) {
+		pending_capacity = pending_capacity == 0 ? 1024 : pending_capacity * 2;
+		pending = allocated(realloc(pending, sizeof(struct pending) * pending_capacity));
+	}
+	struct pending* p = &pending[npending++];
+	p->block = block;
+	p->inum = inum;
+	p->type = type;
+	p->kind = kind;
+	p->index = index;
+}
+
+/**
+ * Check the addresses stored in indirect block indirect, whose contents are
+ * addr, on behalf of inode inum of the given type. Valid addresses of in-use
+ * inodes are counted. The addresses in a double-indirect block are indirect
+ * blocks, which are queued to be checked in turn; those in an indirect block
+ * of a directory are queued to count their entries. index is the position of
+ * the block among the inode's indirect blocks. bs is the block size, a
+ * constant in the specialised copies made by check_indirect().
+ */
+static inline __attribute__((always_inline))
+void check_indirect_bs(uint bs, uint inum, short type, uint indirect, uint* addr, int level, uint index) {
+	uint first = 0, previous = 0;
+	for (uint j = 0; j < NINDIRECT_OF(bs); j++) {
+		if (addr[j] == 0) {
+			continue;
+		}
+		if (!valid_addr(addr[j])) {
+			report(CHECK_INDIRECT_ADDR, inum, addr[j], j);
+			if (repair) {
+				repaired("block %u: indirect entry %u %u -> 0", indirect, j, addr[j]);
+				addr[j] = 0;
+			}
+			continue;
+		}
+		if (type != 0) {
+			use_block(inum, addr[j], 0);
+		}
+		if (level == 1 && type != 0) {
+			if (previous != 0) {
+				block_pairs++;
+				discontiguous += addr[j] != previous + 1;
+			}
+			// A block not right after the previous one starts an extent.
+			if (extents != NULL && (previous == 0 || addr[j] != previous + 1)) {
+				extents[inum]++;
+			}
+			if (first == 0) {
+				first = addr[j];
+			}
+			previous = addr[j];
+		}
+		if (level == 2) {
+			defer(addr[j], inum, type, PENDING_INDIRECT, 2 + j);
+		}
+		else if (type == T_DIR) {
+			defer(addr[j], inum, type, PENDING_DIRECTORY, 0);
+		}
+	}
+	if (extents != NULL && first != 0) {
+		add_segment(inum, index, indirect, first, previous);
+	}
+}
+
+/**
+ * Check an indirect block (level 1) or a double-indirect block (level 2),
+ * using a copy of the loop compiled for the common block sizes.
+ */
+void check_indirect(uint inum, short type, uint indirect, uint* addr, int level, uint index) {
+	switch (bsize) {
+	case 512:
+		check_indirect_bs(512, inum, type, indirect, addr, level, index);
+		break;
+	case 4096:
+		check_indirect_bs(4096, inum, type, indirect, addr, level, index);
+		break;
+	default:
+		check_indirect_bs(bsize, inum, type, indirect, addr, level, index);
+	}
+}
+
+/**
+ * Do what pending block p is waiting for, now that its contents are at data.
+ */
+void process_pending(struct pending* p, uchar* data) {
+	uint entry;
+	touch(1, bsize);
+	switch (p->kind) {
+	case PENDING_INDIRECT:
+		check_indirect(p->inum, p->type, p->block, (uint*)data, 1, p->index);
+		break;
+	case PENDING_DINDIRECT:
+		check_indirect(p->inum, p->type, p->block, (uint*)data, 2, p->index);
+		break;
+	case PENDING_FIRST:
+		// Check the directory format first, then perform the root check.
+		if (directory_format(p->inum, (struct dirent*)data, &entry) == -1) {
+			report(CHECK_DIRECTORY_FORMAT, p->inum, p->block, entry);
+		}
+		if (p->inum == ROOTINO && root_check((struct dirent*)data, &entry) == -1) {
+			report(CHECK_ROOT, p->inum, p->block, entry);
+		}
+		// Skip the first two entries "." and "..".
+		count_entries(p->inum, p->block, (struct dirent*)data, 2);
+		break;
+	case PENDING_DIRECTORY:
+		count_entries(p->inum, p->block, (struct dirent*)data, 0);
+		break;
+	}
+}
+
+/**
+ * Order pending blocks by block number.
+ */
+int compare_pending(const void* a, const void* b) {
+	const struct pending* x = a;
+	const struct pending* y = b;
+	if (x->block != y->block) {
+		return x->block < y->block ? -1 : 1;
+	}
+	return 0;
+}
+
+/**
+ * Return the number of bytes read to fetch the n blocks from block first with
+ * aligned reads.
+ */
+size_t run_bytes(uint first, uint n) {
+	uint64_t start = (uint64_t)first * bsize / IMAGE_ALIGN * IMAGE_ALIGN;
+	uint64_t end = ((uint64_t)(first + n) * bsize + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+	return end - start;
+}
+
+/**
+ * Group the sorted pending blocks from batch[i] on into runs of nearby blocks
+ * that fit in the window together. Return the index of the first pending block
+ * that does not fit, with the runs stored in runs and their number in nruns.
+ */
+uint gather_runs(struct pending* batch, uint i, uint n, struct run* runs, uint* nruns) {
+	size_t used = 0;
+	*nruns = 0;
+	for (; i < n; i++) {
+		uint b = batch[i].block;
+		struct run* last = *nruns == 0 ? NULL : &runs[*nruns - 1];
+		if (last != NULL && b < last->first + last->n) {
+			// Already in the last run.
+			continue;
+		}
+		if (last != NULL && (uint64_t)(b - last->first - last->n) * bsize <= RUN_GAP) {
+			// Extend the last run over the gap, if it still fits.
+			size_t bytes = run_bytes(last->first, b - last->first + 1);
+			if (used - run_bytes(last->first, last->n) + bytes <= window_bytes) {
+				used += bytes - run_bytes(last->first, last->n);
+				last->n = b - last->first + 1;
+				continue;
+			}
+		}
+		if (used + run_bytes(b, 1) > window_bytes) {
+			break;
+		}
+		used += run_bytes(b, 1);
+		runs[*nruns].first = b;
+		runs[*nruns].n = 1;
+		(*nruns)++;
+	}
+	return i;
+}
+
+/**
+ * Read the runs into the window.
+ */
+void read_runs(struct run* runs, uint nruns) {
+	uchar* buf = window;
+	for (uint r = 0; r < nruns; r++) {
+		uint64_t start = (uint64_t)runs[r].first * bsize / IMAGE_ALIGN * IMAGE_ALIGN;
+		size_t bytes = run_bytes(runs[r].first, runs[r].n);
+		if (image_read(&fs.img, buf, start, bytes) == -1) {
+			exit(1);
+		}
+		runs[r].data = buf + ((uint64_t)runs[r].first * bsize - start);
+		buf += bytes;
+	}
+}
+
+/**
+ * Read every pending block in block order and do what it is waiting for.
+ * Indirect blocks of directories queue more blocks, which are read in the
+ * next round. When streaming, nearby blocks are read together into the window
+ * while the next window is prefetched.
+ */
+void run_pending() {
+	int previous_phase = enter_phase(PHASE_BLOCKS);
+	uint max_runs = window_bytes / IMAGE_ALIGN + 1;
+	struct run* runs = allocated(malloc(sizeof(struct run) * max_runs));
+	struct run* next_runs = allocated(malloc(sizeof(struct run) * max_runs));
+	struct pending* batch = NULL;
+	uint batch_capacity = 0;
+	while (npending > 0 && !truncated) {
+		// Take the queue as this round's batch; new blocks go to a fresh queue.
+		struct pending* swap = batch;
+		uint n = npending;
+		batch = pending;
+		pending = swap;
+		uint capacity = batch_capacity;
+		batch_capacity = pending_capacity;
+		pending_capacity = capacity;
+		npending = 0;
+		qsort(batch, n, sizeof(struct pending), compare_pending);
+		if (fs.img.map != NULL) {
+			for (uint i = 0; i < n && !truncated; i++) {
+				process_pending(&batch[i], block_ptr(batch[i].block));
+			}
+			continue;
+		}
+		uint nruns, next_nruns;
+		uint i = 0;
+		uint j = gather_runs(batch, i, n, runs, &nruns);
+		while (i < n && !truncated) {
+			// Start reading the next window before processing this one.
+			uint k = gather_runs(batch, j, n, next_runs, &next_nruns);
+			for (uint r = 0; r < next_nruns; r++) {
+				image_prefetch(&fs.img, (uint64_t)next_runs[r].first * bsize,
+					(size_t)next_runs[r].n * bsize);
+			}
+			read_runs(runs, nruns);
+			uint r = 0;
+			for (; i < j && !truncated; i++) {
+				while (batch[i].block >= runs[r].first + runs[r].n) {
+					r++;
+				}
+				process_pending(&batch[i], runs[r].data +
+					(uint64_t)(batch[i].block - runs[r].first) * bsize);
+			}
+			struct run* tmp = runs;
+			runs = next_runs;
+			next_runs = tmp;
+			nruns = next_nruns;
+			j = k;
+		}
+	}
+	free(batch);
+	free(runs);
+	free(next_runs);
+	enter_phase(previous_phase);
+}
+
+/**
+ * Return the n inodes starting from inode first. When streaming they are read
+ * into inode_buffer and stay valid until the next call.
+ */
+struct dinode* read_inodes(uint first, uint n) {
+	if (fs.img.map != NULL) {
+		return inode_table + first;
+	}
+	uint64_t offset = (uint64_t)bsize * 2 + (uint64_t)first * sizeof(struct dinode);
+	uint64_t start = offset / IMAGE_ALIGN * IMAGE_ALIGN;
+	uint64_t end = offset + (uint64_t)n * sizeof(struct dinode);
+	end = (end + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+	if (image_read(&fs.img, inode_buffer, start, end - start) == -1) {
+		exit(1);
+	}
+	return (struct dinode*)((uchar*)inode_buffer + (offset - start));
+}
+
+/**
+ * Run every per-inode check on inode inum, stored at dip. Each direct address
+ * is validated and counted while the inode is visited. Blocks whose contents
+ * are needed (indirect blocks and directory blocks) are queued and checked by
+ * run_pending() in block order, so each is read only once. The bitmap is
+ * compared with the counted blocks after the pass.
+ */
+void check_inode(uint inum, struct dinode* dip) {
+	touch(1, sizeof(struct dinode));
+	if (inode_type(dip) == -1) {
+		report(CHECK_INODE_TYPE, inum, NONE, NONE);
+	}
+	if (dip->type != 0) {
+		set_bit(in_use, inum);
+	}
+	if (dip->type == T_DIR) {
+		set_bit(directories, inum);
+	}
+	// The root inode must be a directory.
+	if (inum == ROOTINO && dip->type != T_DIR) {
+		report(CHECK_ROOT, inum, NONE, NONE);
+	}
+	// A directory needs a first block holding "." and "..".
+	if (dip->type == T_DIR && !valid_addr(dip->addrs[0])) {
+		report(CHECK_DIRECTORY_FORMAT, inum, dip->addrs[0], NONE);
+		if (inum == ROOTINO) {
+			report(CHECK_ROOT, inum, dip->addrs[0], NONE);
+		}
+	}
+	uint first = 0, previous = 0;
+	for (uint j = 0; j < ndirect; j++) {
+		uint addr = dip->addrs[j];
+		if (addr == 0) {
+			continue;
+		}
+		if (!valid_addr(addr)) {
+			report(CHECK_DIRECT_ADDR, inum, addr, j);
+			if (repair) {
+				repaired("inode %u: addrs[%u] %u -> 0", inum, j, addr);
+				dip->addrs[j] = 0;
+			}
+			continue;
+		}
+		if (dip->type != 0) {
+			if (previous != 0) {
+				block_pairs++;
+				discontiguous += addr != previous + 1;
+			}
+			// A block not right after the previous one starts an extent.
+			if (extents != NULL && (previous == 0 || addr != previous + 1)) {
+				extents[inum]++;
+			}
+			if (first == 0) {
+				first = addr;
+			}
+			previous = addr;
+			use_block(inum, addr, 1);
+			if (dip->type == T_DIR) {
+				defer(addr, inum, dip->type, j == 0 ? PENDING_FIRST : PENDING_DIRECTORY, 0);
+			}
+		}
+	}
+	if (extents != NULL && first != 0 && dip->type != 0 && valid_addr(dip->addrs[ndirect])) {
+		add_segment(inum, 0, 0, first, previous);
+	}
+	// The block addresses that the indirect pointers point at.
+	for (uint j = ndirect; j < ndirect + 1 + dindirect; j++) {
+		uint indirect = dip->addrs[j];
+		if (indirect == 0) {
+			continue;
+		}
+		if (!valid_addr(indirect)) {
+			report(CHECK_INDIRECT_ADDR, inum, indirect, j);
+			if (repair) {
+				repaired("inode %u: addrs[%u] %u -> 0", inum, j, indirect);
+				dip->addrs[j] = 0;
+			}
+			continue;
+		}
+		if (dip->type != 0) {
+			use_block(inum, indirect, 0);
+		}
+		defer(indirect, inum, dip->type, j == ndirect ? PENDING_INDIRECT : PENDING_DINDIRECT, 1);
+	}
+}
+
+/**
+ * Visit every inode once, performing all per-inode checks together. The inode
+ * table is read in chunks, and the pending blocks are read whenever enough of
+ * them have been queued.
+ */
+void check_inodes() {
+	enter_phase(PHASE_INODES);
+	for (uint first = 0; first < ninodes && !truncated; first += chunk_inodes) {
+		uint n = ninodes - first < chunk_inodes ? ninodes - first : chunk_inodes;
+		struct dinode* dips = read_inodes(first, n);
+		for (uint k = 0; k < n && !truncated; k++) {
+			check_inode(first + k, &dips[k]);
+		}
+		if (npending >= max_pending) {
+			run_pending();
+		}
+	}
+	run_pending();
+}
+
+/**
+ * Fill in the geometry of the image in s.
+ */
+void state_geometry(struct state* s) {
+	s->bsize = bsize;
+	s->size = size;
+	s->nblocks = nblocks;
+	s->ninodes = ninodes;
+	s->dindirect = dindirect;
+	s->region_inodes = IPB_OF(bsize) * REGION_BLOCKS;
+	s->nregions = (ninodes + s->region_inodes - 1) / s->region_inodes;
+	s->nbitmap = size / BPB_OF(bsize) + 1;
+}
+
+/**
+ * Mix indirect block addr into hash h, followed by the blocks it points to
+ * if they are directory blocks.
+ */
+uint64_t hash_indirect(uint64_t h, uint addr, int directory) {
+	uint* indirect = block_ptr(addr);
+	h = state_hash(h, indirect, bsize);
+	for (uint j = 0; directory && j < nindirect; j++) {
+		if (valid_addr(indirect[j])) {
+			h = state_hash(h, block_ptr(indirect[j]), bsize);
+		}
+	}
+	return h;
+}
+
+/**
+ * Return the hash of region r: its inodes and every block a check reads on
+ * their behalf, which are the indirect blocks and the directory blocks.
+ */
+uint64_t region_hash(uint r) {
+	uint first = r * state.region_inodes;
+	uint n = ninodes - first < state.region_inodes ? ninodes - first : state.region_inodes;
+	uint64_t h = state_hash(r, inode_table + first, (size_t)n * sizeof(struct dinode));
+	for (uint i = first; i < first + n; i++) {
+		struct dinode* dip = &inode_table[i];
+		int directory = dip->type == T_DIR;
+		for (uint j = 0; directory && j < ndirect; j++) {
+			if (valid_addr(dip->addrs[j])) {
+				h = state_hash(h, block_ptr(dip->addrs[j]), bsize);
+			}
+		}
+		if (valid_addr(dip->addrs[ndirect])) {
+			h = hash_indirect(h, dip->addrs[ndirect], directory);
+		}
+		if (dindirect && valid_addr(dip->addrs[ndirect + 1])) {
+			uint* dind = block_ptr(dip->addrs[ndirect + 1]);
+			h = state_hash(h, dind, bsize);
+			for (uint j = 0; j < nindirect; j++) {
+				if (valid_addr(dind[j])) {
+					h = hash_indirect(h, dind[j], directory);
+				}
+			}
+		}
+	}
+	return h;
+}
+
+/**
+ * Hash every region and bitmap block into state. Set *nchanged to the number
+ * of regions whose hash differs from the one saved, marking them in changed,
+ * and *bitmap_changed if any bitmap block differs.
+ */
+void hash_image(uchar* changed, uint* nchanged, int* bitmap_changed) {
+	*nchanged = 0;
+	*bitmap_changed = 0;
+	touch(state.nregions + state.nbitmap, (uint64_t)ninodes * sizeof(struct dinode) +
+		(uint64_t)state.nbitmap * bsize);
+	for (uint r = 0; r < state.nregions; r++) {
+		uint64_t h = region_hash(r);
+		if (h != state.regions[r]) {
+			changed[r] = 1;
+			(*nchanged)++;
+			state.regions[r] = h;
+		}
+	}
+	for (uint k = 0; k < state.nbitmap; k++) {
+		uint64_t h = state_hash(k, bitmap + (size_t)k * bsize, bsize);
+		if (h != state.bitmap[k]) {
+			*bitmap_changed = 1;
+			state.bitmap[k] = h;
+		}
+	}
+	hashed = 1;
+}
+
+/**
+ * Start a state for a check of the whole image.
+ */
+void new_state() {
+	state_free(&state);
+	state_geometry(&state);
+	if (state_alloc(&state) == -1) {
+		fprintf(stderr, "malloc() failed.\n");
+		exit(1);
+	}
+	edge_capacity = 0;
+	hashed = 0;
+}
+
+/**
+ * Return 1 if every inode the loaded state names, as the owner of a block or
+ * at either end of a directory entry, is an inode of this image. Return 0
+ * otherwise. The checksum of a state file does not tell that it was saved
+ * for this image.
+ */
+int state_in_range() {
+	for (uint b = 0; b < size; b++) {
+		uint owner = state.owner[b];
+		if (owner != STATE_FREE && owner != STATE_SHARED && owner >= ninodes) {
+			return 0;
+		}
+	}
+	for (uint e = 0; e < 2 * state.nedges; e++) {
+		if (state.edges[e] >= ninodes) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Check only the regions of the inode table that changed since the clean
+ * check saved in the state file. What the unchanged regions use is taken from
+ * the state: their blocks, the entries of their directories and whether they
+ * hold directories. The bitmap, references and directory tree are checked
+ * again only if a region or the bitmap changed, and the tree only if a changed
+ * inode is or was a directory. Return 0 if the image was checked. Return -1 if
+ * there is no usable state, with a new one started for a full check. A state
+ * of another geometry or naming inodes out of range is not usable.
+ */
+int check_changed() {
+	struct state expected;
+	state_geometry(&expected);
+	if (state_load(&state, state_path) == -1 || state.bsize != expected.bsize ||
+		state.size != expected.size || state.nblocks != expected.nblocks ||
+		state.ninodes != expected.ninodes || state.dindirect != expected.dindirect ||
+		state.region_inodes != expected.region_inodes || state.nregions != expected.nregions ||
+		state.nbitmap != expected.nbitmap || !state_in_range()) {
+		new_state();
+		return -1;
+	}
+	edge_capacity = state.nedges;
+	uchar* changed = allocated(calloc(state.nregions, 1));
+	uint nchanged;
+	int bitmap_changed;
+	enter_phase(PHASE_STATE);
+	hash_image(changed, &nchanged, &bitmap_changed);
+	enter_phase(PHASE_INODES);
+	rescan_bitmap = nchanged > 0 || bitmap_changed;
+	rescan_references = nchanged > 0;
+	rescan_tree = 0;
+	// A block shared by several inodes cannot be given back to one of them.
+	for (uint b = 0; b < size && nchanged > 0; b++) {
+		if (state.owner[b] == STATE_SHARED) {
+			free(changed);
+			new_state();
+			rescan_bitmap = rescan_references = rescan_tree = 1;
+			return -1;
+		}
+	}
+	// Keep the blocks of unchanged regions and forget those of changed ones.
+	for (uint b = 0; b < size; b++) {
+		uint owner = state.owner[b];
+		if (owner == STATE_FREE) {
+			continue;
+		}
+		if (owner != STATE_SHARED && changed[owner / state.region_inodes]) {
+			state.owner[b] = STATE_FREE;
+			continue;
+		}
+		set_bit(blocks_used, b);
+		if (test_bit(state.direct, b)) {
+			set_bit(blocks_direct, b);
+		}
+	}
+	// The inodes of unchanged regions need no check, only their types.
+	for (uint r = 0; r < state.nregions; r++) {
+		uint first = r * state.region_inodes;
+		uint n = ninodes - first < state.region_inodes ? ninodes - first : state.region_inodes;
+		for (uint i = first; i < first + n && !changed[r]; i++) {
+			if (inode_table[i].type != 0) {
+				set_bit(in_use, i);
+			}
+			if (inode_table[i].type == T_DIR) {
+				set_bit(directories, i);
+			}
+		}
+	}
+	if (nchanged == 0) {
+		free(changed);
+		return 0;
+	}
+	// Likewise for the entries of their directories.
+	uint kept = 0;
+	for (uint e = 0; e < state.nedges; e++) {
+		uint dir = state.edges[2 * e];
+		uint inum = state.edges[2 * e + 1];
+		if (changed[dir / state.region_inodes]) {
+			continue;
+		}
+		state.edges[2 * kept] = dir;
+		state.edges[2 * kept + 1] = inum;
+		kept++;
+		if (count[inum] != COUNT_MAX) {
+			count[inum]++;
+		}
+	}
+	state.nedges = kept;
+	for (uint r = 0; r < state.nregions && !truncated; r++) {
+		uint first = r * state.region_inodes;
+		uint n = ninodes - first < state.region_inodes ? ninodes - first : state.region_inodes;
+		for (uint i = first; i < first + n && changed[r] && !truncated; i++) {
+			check_inode(i, &inode_table[i]);
+			if (test_bit(state.directories, i) || test_bit(directories, i)) {
+				rescan_tree = 1;
+			}
+		}
+		if (npending >= max_pending) {
+			run_pending();
+		}
+	}
+	run_pending();
+	free(changed);
+	return 0;
+}
+
+/**
+ * Save the state of this clean check for the next one.
+ */
+void save_state() {
+	enter_phase(PHASE_STATE);
+	if (!hashed) {
+		uchar* changed = allocated(calloc(state.nregions, 1));
+		uint nchanged;
+		int bitmap_changed;
+		hash_image(changed, &nchanged, &bitmap_changed);
+		free(changed);
+	}
+	memcpy(state.direct, blocks_direct, (size_t)(size + 63) / 64 * sizeof(uint64_t));
+	memcpy(state.directories, directories, (size_t)(ninodes + 63) / 64 * sizeof(uint64_t));
+	if (state_save(&state, state_path) == -1) {
+		fprintf(stderr, "state not saved.\n");
+	}
+}
+
+/**
+ * Order blocks by address.
+ */
+int compare_owned(const void* a, const void* b) {
+	const struct owned* x = a;
+	const struct owned* y = b;
+	return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/**
+ * Return the inode that uses block addr, marked free in the bitmap, or NONE if
+ * it is not known. The state names the owner of every block; otherwise the
+ * blocks recorded by use_block(), sorted, are searched.
+ */
+uint marked_free_owner(uint addr) {
+	if (state.owner != NULL && state.owner[addr] != STATE_FREE && state.owner[addr] != STATE_SHARED) {
+		return state.owner[addr];
+	}
+	uint lo = 0, hi = nmarked_free;
+	while (lo < hi) {
+		uint mid = lo + (hi - lo) / 2;
+		if (marked_free[mid].block < addr) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo < nmarked_free && marked_free[lo].block == addr ? marked_free[lo].inum : NONE;
+}
+
+/**
+ * Add block addr of inode inum to the run of blocks with errors from check
+ * that starts at *start and ends at *last in inode *owner, reporting the run
+ * first if addr does not extend it.
+ */
+void extend_run(uint check, uint* start, uint* last, uint* owner, uint addr, uint inum) {
+	if (*start != NONE && *last + 1 == addr && *owner == inum) {
+		*last = addr;
+		return;
+	}
+	if (*start != NONE) {
+		report_range(check, *owner, *start, *last);
+	}
+	*start = addr;
+	*last = addr;
+	*owner = inum;
+}
+
+/**
+ * Compare the bitmap with the blocks found in use. For in-use inodes, each
+ * address in use must also be marked in use in the bitmap, and each block
+ * marked in use must actually be in use in an inode or indirect block. Equal
+ * stretches are skipped 256 bits at a time by bitmap_mismatch(); mismatching
+ * blocks are reported as runs, those in use split by the inode using them.
+ */
+void bitmap_check() {
+	enter_phase(PHASE_BITMAP);
+	// Runs of blocks in use but marked free, and marked in use but free.
+	uint free_start = NONE, free_last = NONE, free_owner = NONE;
+	uint used_start = NONE, used_last = NONE, used_owner = NONE;
+	uint last = (size + 63) / 64;
+	qsort(marked_free, nmarked_free, sizeof(struct owned), compare_owned);
+	// Start from data blocks.
+	uint w = data_blocks / 64;
+	while (!truncated) {
+		w = bitmap_mismatch((const uint64_t*)bitmap, blocks_used, w, last);
+		if (w == last) {
+			break;
+		}
+		uint64_t disk = bitmap_word(w) & data_mask(w);
+		uint64_t used = blocks_used[w] & data_mask(w);
+		// Visit the differing bits in block order.
+		uint64_t diff = disk ^ used;
+		while (diff != 0 && !truncated) {
+			uint addr = w * 64 + __builtin_ctzll(diff);
+			if ((used >> (addr % 64)) & 1) {
+				uint owner = report_all ? marked_free_owner(addr) : NONE;
+				extend_run(CHECK_ADDRESS_BITMAP, &free_start, &free_last, &free_owner, addr, owner);
+			}
+			else {
+				extend_run(CHECK_MARKED_USED, &used_start, &used_last, &used_owner, addr, NONE);
+			}
+			// Clear the lowest set bit.
+			diff &= diff - 1;
+		}
+		w++;
+	}
+	if (free_start != NONE) {
+		report_range(CHECK_ADDRESS_BITMAP, free_owner, free_start, free_last);
+	}
+	if (used_start != NONE) {
+		report_range(CHECK_MARKED_USED, used_owner, used_start, used_last);
+	}
+	// The bitmap and the bit set of blocks in use, a word of each per item.
+	touch(last - data_blocks / 64, (uint64_t)(last - data_blocks / 64) * 2 * sizeof(uint64_t));
+}
+
+/**
+ * Order segments by inode, then by part.
+ */
+int compare_segments(const void* a, const void* b) {
+	const struct segment* x = a;
+	const struct segment* y = b;
+	if (x->inum != y->inum) {
+		return x->inum < y->inum ? -1 : 1;
+	}
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/**
+ * Merge the extents that run on from one part of a file into the next, which
+ * the pass over the inode table counted twice. The indirect block of the next
+ * part, and the double-indirect block before the first part under it, are
+ * read on the way and do not break the extent.
+ */
+void join_segments() {
+	qsort(segments, nsegments, sizeof(struct segment), compare_segments);
+	for (uint i = 1; i < nsegments; i++) {
+		struct segment* s = &segments[i - 1];
+		struct segment* t = &segments[i];
+		if (s->inum != t->inum || s->index + 1 != t->index) {
+			continue;
+		}
+		uint gap = t->index == 2 ? 2 : 1;
+		if (t->first == s->last + 1 ||
+			(t->block > s->last && t->block - s->last <= gap && t->first == t->block + 1)) {
+			extents[t->inum]--;
+		}
+	}
+	free(segments);
+	segments = NULL;
+	nsegments = segment_capacity = 0;
+}
+
+/**
+ * Add a run of n to a histogram with a bucket per power of two.
+ */
+void add_run(uint64_t* histogram, uint64_t n) {
+	histogram[63 - __builtin_clzll(n)]++;
+}
 
 /**
- * Check the type of each inode. Each inode is either unallocated or one of
- * the valid types. Return 0 if all inodes have valid type. Return -1 if there
- * is an error.
+ * Print the non-empty buckets of a histogram made by add_run().
  */
-int inode_type() {
-	for (uint i = 0; i < ninodes; i++) {
-		short type = inode_table[i].type;
-		if ((type != 0) && (type != T_FILE) && (type != T_DIR) &&
-			(type != T_DEV)) {
-			return -1;
+void print_histogram(const char* name, uint64_t* histogram) {
+	fprintf(stderr, "%s:", name);
+	for (int b = 0; b < 64; b++) {
+		if (histogram[b] == 0) {
+			continue;
+		}
+		if (b == 0) {
+			fprintf(stderr, " 1=%llu", (unsigned long long)histogram[b]);
+		}
+		else {
+			fprintf(stderr, " %llu-%llu=%llu", 1ULL << b, (2ULL << b) - 1,
+				(unsigned long long)histogram[b]);
 		}
 	}
-	return 0;
+	fprintf(stderr, "\n");
 }
 
 /**
- * For in-use inodes, check if each address in the direct block is valid.
- * Return 0 if all direct addresses are valid. Return -1 if there is an error.
+ * Print the extents of each fragmented file, how many extents files have and
+ * the runs of free data blocks in the bitmap to stderr. Reading every file
+ * from start to end takes a seek per extent, not counting indirect blocks.
  */
-int direct_addr() {
-	for (uint i = 0; i < ninodes; i++) {
-		for (uint j = 0; j < NDIRECT; j++) {
-			uint addr = inode_table[i].addrs[j];
-			if (addr != 0 && ((addr < data_blocks) || (addr >= size))) {
-				return -1;
+void print_fragmentation() {
+	uint64_t files = 0, fragmented = 0, total = 0, histogram[64] = {0};
+	for (uint inum = 0; inum < ninodes; inum++) {
+		if (extents[inum] == 0) {
+			continue;
+		}
+		files++;
+		total += extents[inum];
+		add_run(histogram, extents[inum]);
+		if (extents[inum] > 1) {
+			fragmented++;
+			fprintf(stderr, "fragmentation: inode=%u extents=%u\n", inum, extents[inum]);
+		}
+	}
+	fprintf(stderr, "fragmentation: files=%llu fragmented=%llu extents=%llu "
+		"mean_extents=%.2f seeks=%llu\n", (unsigned long long)files,
+		(unsigned long long)fragmented, (unsigned long long)total,
+		files == 0 ? 0.0 : (double)total / files, (unsigned long long)total);
+	print_histogram("fragmentation: extents", histogram);
+
+	// Runs of free data blocks, whole words at a time where possible.
+	uint64_t runs = 0, free_blocks = 0, largest = 0, run = 0;
+	memset(histogram, 0, sizeof(histogram));
+	for (uint w = data_blocks / 64; w < (size + 63) / 64; w++) {
+		uint64_t mask = data_mask(w);
+		uint64_t free_bits = ~bitmap_word(w) & mask;
+		free_blocks += __builtin_popcountll(free_bits);
+		if (free_bits == ~(uint64_t)0) {
+			run += 64;
+			continue;
+		}
+		for (uint bit = 0; bit < 64; bit++) {
+			if (!((mask >> bit) & 1)) {
+				continue;
+			}
+			if ((free_bits >> bit) & 1) {
+				run++;
+			}
+			else if (run != 0) {
+				runs++;
+				add_run(histogram, run);
+				largest = run > largest ? run : largest;
+				run = 0;
 			}
 		}
 	}
-	return 0;
+	if (run != 0) {
+		runs++;
+		add_run(histogram, run);
+		largest = run > largest ? run : largest;
+	}
+	fprintf(stderr, "free_space: runs=%llu blocks=%llu largest=%llu\n", (unsigned long long)runs,
+		(unsigned long long)free_blocks, (unsigned long long)largest);
+	print_histogram("free_space: runs", histogram);
 }
 
 /**
- * For in-use inodes, check if each indirect address is valid. Return 0 if all
- * indirect blocks are valid. Return -1 if there is an error.
+ * Check for condition 9 ~ 12 using the reference counts gathered by the pass
+ * over the inode table. Unless every violation is wanted, stop at the first
+ * inode with an error.
  */
-int indirect_addr() {
-	for (uint i = 0; i < ninodes; i++) {
-		// The block address that the indirect pointer points at.
-		uint indirect_addr = inode_table[i].addrs[NDIRECT];
-		if (indirect_addr == 0) {
-			continue;
-		}
-		if (indirect_addr != 0 && ((indirect_addr < data_blocks) ||
-			(indirect_addr >= size))) {
-			return -1;
-		}
-		// Starting address of the data block that stores the addresses to the
-		// actual user data blocks.
-		uint* addr = (uint*)(img_ptr + BSIZE * indirect_addr);
-		for (uint j = 0; j < NINDIRECT; j++) {
-			if (addr[j] != 0 && ((addr[j] < data_blocks) || (addr[j] >= size))) {
-				return -1;
+void check_references() {
+	enter_phase(PHASE_REFERENCES);
+	for (uint first = 0; first < ninodes && !truncated; first += chunk_inodes) {
+		uint n = ninodes - first < chunk_inodes ? ninodes - first : chunk_inodes;
+		struct dinode* dips = read_inodes(first, n);
+		touch(n, (uint64_t)n * (sizeof(struct dinode) + sizeof(ushort)));
+		for (uint k = 0; k < n && !truncated; k++) {
+			uint i = first + k;
+			// Every inode in use must be referenced at least once.
+			if (dips[k].type != 0 && count[i] == 0) {
+				report(CHECK_INODE_UNREFERENCED, i, NONE, NONE);
+			}
+			// Inode is referred to some other directories, but it is not in use.
+			if (dips[k].type == 0 && count[i] != 0) {
+				report(CHECK_INODE_REFERRED_FREE, i, NONE, NONE);
+			}
+			// Check if a directory has more than one link.
+			if (dips[k].type == T_DIR && count[i] > 1) {
+				report(CHECK_DIRECTORY_LINKED_TWICE, i, NONE, NONE);
+			}
+			// Check if nlinks is consistent for regular file.
+			if (dips[k].type == T_FILE && count[i] != dips[k].nlink) {
+				report(CHECK_REFERENCE_COUNT, i, NONE, NONE);
+			}
+			if (!report_all && !repair && failed) {
+				return;
 			}
 		}
 	}
-	return 0;
 }
 
+// A directory on the stack of the tree walk, reached from directory parent.
+// post marks the entry popped once the directory's subtree is done.
+struct frame {
+	uint inum;
+	uint parent;
+	int post;
+};
+
+struct frame* stack;               /* Stack of the tree walk. */
+uint nstack;                       /* Number of frames on the stack. */
+uint stack_capacity;               /* Allocated frames. */
+uchar* walk_buffers[3];            /* Blocks read by the walk while streaming. */
+struct dir_index names;            /* Names in the directory being walked. */
+char* path = NULL;                 /* Path to resolve after the checks. */
+
 /**
- * Check if root directory exists. Returns 0 if the root inode is consistent.
- * Return -1 if there is an error.
+ * Push a frame for directory inum onto the walk stack.
  */
-int root_check() {
-	// The inode number of root inode is 1.
-	if (inode_table[1].type != T_DIR) {
-		return -1;
+void push_frame(uint inum, uint parent, int post) {
+	if (nstack == stack_capacity) {
+		stack_capacity = stack_capacity == 0 ? 1024 : stack_capacity * 2;
+		stack = allocated(realloc(stack, sizeof(struct frame) * stack_capacity));
 	}
-	// Get the first block address of root directory entries.
-	uint addr = inode_table[1].addrs[0];
-	struct dirent* directory_entry = (struct dirent*)(img_ptr + BSIZE * addr);
-	// The parent of the root directory is itself.
-	if (!((directory_entry[0].inum == 1) && (directory_entry[1].inum == 1))) {
-		return -1;
+	stack[nstack].inum = inum;
+	stack[nstack].parent = parent;
+	stack[nstack].post = post;
+	nstack++;
+}
+
+/**
+ * Return the contents of block addr for the walk. When streaming, the block
+ * is read into walk_buffers[level], so blocks of different levels can be used
+ * at the same time.
+ */
+void* walk_block(uint addr, int level) {
+	touch(1, bsize);
+	if (fs.img.map != NULL) {
+		return block_ptr(addr);
 	}
-	return 0;
+	uint64_t offset = (uint64_t)bsize * addr;
+	uint64_t start = offset / IMAGE_ALIGN * IMAGE_ALIGN;
+	if (image_read(&fs.img, walk_buffers[level], start, run_bytes(addr, 1)) == -1) {
+		exit(1);
+	}
+	return walk_buffers[level] + (offset - start);
 }
 
 /**
- * Perform integrity checks on the contents of each directory, making sure that
- * "." and ".." are the first entries. The "." entry points to itself. Return 0
- * if the format of each directory is correct. Return -1 if there is an error.
+ * Walk the entries of directory block addr of directory dir, which was reached
+ * from directory parent. The ".." entry of the first block must point to the
+ * parent, and no name may appear twice in the directory. Files are marked
+ * reached. Subdirectories not yet reached are pushed; a subdirectory still
+ * being walked is an ancestor, so the entry closes a cycle.
  */
-int directory_format() {
-	for (uint i = 0; i < ninodes; i++) {
-		if (inode_table[i].type == T_DIR) {
-			// Block address of directory entries.
-			uint addr = inode_table[i].addrs[0];
-			// Address of the first direcotry entry.
-			struct dirent* directory_entry = (struct dirent*)(img_ptr + BSIZE * addr);
-			if (!((strcmp(directory_entry[0].name, ".") == 0) &&
-				(directory_entry[0].inum == i) &&
-				(strcmp(directory_entry[1].name, "..") == 0))) {
-				return -1;
-			}
+void walk_entries(uint dir, uint parent, uint addr, int first) {
+	struct dirent* directory_entry = walk_block(addr, 0);
+	uint num = bsize / (sizeof(struct dirent));
+	if (first && directory_entry[1].inum != parent) {
+		report(CHECK_PARENT, dir, addr, 1);
+		if (repair && !(failed & STRUCTURAL)) {
+			repaired("inode %u: \"..\" %u -> %u", dir, directory_entry[1].inum, parent);
+			directory_entry[1].inum = parent;
+		}
+	}
+	for (uint k = 0; k < num; k++) {
+		uint inum = directory_entry[k].inum;
+		if (inum == 0) {
+			continue;
+		}
+		int duplicate = dir_index_add(&names, &directory_entry[k]);
+		if (duplicate == -1) {
+			fprintf(stderr, "malloc() failed.\n");
+			exit(1);
+		}
+		if (duplicate) {
+			report(CHECK_DUPLICATE_NAME, dir, addr, k);
+		}
+		// Skip the first two entries "." and "..".
+		if ((first && k < 2) || inum >= ninodes) {
+			continue;
+		}
+		if (!test_bit(directories, inum)) {
+			set_bit(visited, inum);
+		}
+		else if (test_bit(on_path, inum)) {
+			report(CHECK_DIRECTORY_CYCLE, dir, addr, k);
+		}
+		else if (!test_bit(visited, inum)) {
+			push_frame(inum, dir, 0);
 		}
 	}
-	return 0;
 }
 
 /**
- * For in-use inodes, check if each address in use is also marked in use in the
- * bitmap. Return 0 if they are consistent. Return -1 if there is an error.
+ * Add the entries of directory block addr of directory dir to the index of
+ * names.
  */
-int address_bitmap() {
-	for (uint i = 0; i < ninodes; i++) {
-		if (inode_table[i].type != 0) {
-			for (uint j = 0; j < NDIRECT; j++) {
-				// Block address.
-				uint addr = inode_table[i].addrs[j];
-				if (addr != 0) {
-					if (!((bitmap[addr / 8] >> (addr % 8)) & 1)) {
-						return -1;
-					}
-				}
-			}
-			// Indirect pointer is in-use.
-			if (inode_table[i].addrs[NDIRECT] != 0) {
-				uint* addr = (uint*)(img_ptr + BSIZE * inode_table[i].addrs[NDIRECT]);
-				for (uint j = 0; j < NINDIRECT; j++) {
-					if (addr[j] != 0) {
-						if (!((bitmap[addr[j] / 8] >> (addr[j] % 8)) & 1)) {
-							return -1;
-						}
-					}
-				}
+void index_entries(uint dir, uint parent, uint addr, int first) {
+	(void)dir;
+	(void)parent;
+	(void)first;
+	struct dirent* directory_entry = walk_block(addr, 0);
+	uint num = bsize / (sizeof(struct dirent));
+	for (uint k = 0; k < num; k++) {
+		if (directory_entry[k].inum != 0) {
+			if (dir_index_add(&names, &directory_entry[k]) == -1) {
+				fprintf(stderr, "malloc() failed.\n");
+				exit(1);
 			}
 		}
 	}
-	return 0;
 }
 
 /**
- * Count the number of times that each address is used.
+ * Pass every block of directory dir, which was reached from directory parent,
+ * to walk_entries() or index_entries(), starting with an empty index of names.
+ * The index is sized from the blocks the directory has rather than from its
+ * size, which a damaged inode can make arbitrarily large.
  */
-void address_count() {
-	for (uint i = 0; i < ninodes; i++) {
-		if (inode_table[i].type != 0) {
-			for (uint j = 0; j < NDIRECT; j++) {
-				// Block address.
-				uint addr = inode_table[i].addrs[j];
-				if (addr != 0) {
-					blocks_used[addr]++;
-				}
+void walk_directory(uint dir, uint parent, void (*visit)(uint, uint, uint, int)) {
+	struct dinode dip = *read_inodes(dir, 1);
+	uint64_t held = 0;
+	for (uint j = 0; j < ndirect; j++) {
+		held += valid_addr(dip.addrs[j]);
+	}
+	uint* indirect = NULL;
+	if (valid_addr(dip.addrs[ndirect])) {
+		indirect = walk_block(dip.addrs[ndirect], 1);
+		for (uint j = 0; j < nindirect; j++) {
+			held += valid_addr(indirect[j]);
+		}
+	}
+	uint* dind = NULL;
+	if (dindirect && valid_addr(dip.addrs[ndirect + 1])) {
+		dind = walk_block(dip.addrs[ndirect + 1], 2);
+		for (uint i = 0; i < nindirect; i++) {
+			held += (uint64_t)valid_addr(dind[i]) * nindirect;
+		}
+	}
+	if (held > size - data_blocks) {
+		held = size - data_blocks;
+	}
+	uint64_t expected = dip.size / sizeof(struct dirent);
+	if (expected > held * (bsize / sizeof(struct dirent))) {
+		expected = held * (bsize / sizeof(struct dirent));
+	}
+	if (dir_index_reset(&names, expected) == -1) {
+		fprintf(stderr, "malloc() failed.\n");
+		exit(1);
+	}
+	for (uint j = 0; j < ndirect; j++) {
+		if (valid_addr(dip.addrs[j])) {
+			visit(dir, parent, dip.addrs[j], j == 0);
+		}
+	}
+	if (indirect != NULL) {
+		for (uint j = 0; j < nindirect; j++) {
+			if (valid_addr(indirect[j])) {
+				visit(dir, parent, indirect[j], 0);
+			}
+		}
+	}
+	if (dind != NULL) {
+		for (uint i = 0; i < nindirect; i++) {
+			if (!valid_addr(dind[i])) {
+				continue;
 			}
-			// Indirect pointer is in-use.
-			if (inode_table[i].addrs[NDIRECT] != 0) {
-				blocks_used[inode_table[i].addrs[NDIRECT]]++;
-				uint* addr = (uint*)(img_ptr + BSIZE * inode_table[i].addrs[NDIRECT]);
-				for (uint j = 0; j < NINDIRECT; j++) {
-					if (addr[j] != 0) {
-						blocks_used[addr[j]]++;
-					}
+			indirect = walk_block(dind[i], 1);
+			for (uint j = 0; j < nindirect; j++) {
+				if (valid_addr(indirect[j])) {
+					visit(dir, parent, indirect[j], 0);
 				}
 			}
 		}
@@ -180,222 +1724,639 @@ void address_count() {
 }
 
 /**
- * For in-use inodes, check if direct address is only used once.
+ * Walk the directory tree from the root depth first with an explicit stack,
+ * checking that the ".." entry of each directory points to the directory it
+ * was reached from and that no directory contains one of its ancestors. Then
+ * report in-use inodes that are referred to but cannot be reached from the
+ * root. Reached and on-path inodes are kept in bit sets.
  */
-int direct_once() {
-	for (uint i = 0; i < ninodes; i++) {
-		if (inode_table[i].type != 0) {
-			for (uint j = 0; j < NDIRECT; j++) {
-				uint addr = inode_table[i].addrs[j];
-				if (addr != 0 && blocks_used[addr] > 1) {
-					return -1;
-				}
+void walk_tree() {
+	enter_phase(PHASE_TREE);
+	if (!test_bit(directories, ROOTINO)) {
+		return;
+	}
+	push_frame(ROOTINO, ROOTINO, 0);
+	while (nstack > 0 && !truncated) {
+		struct frame f = stack[--nstack];
+		if (f.post) {
+			clear_bit(on_path, f.inum);
+			continue;
+		}
+		// A directory pushed twice is walked once.
+		if (test_bit(visited, f.inum)) {
+			continue;
+		}
+		set_bit(visited, f.inum);
+		set_bit(on_path, f.inum);
+		push_frame(f.inum, f.parent, 1);
+		walk_directory(f.inum, f.parent, walk_entries);
+	}
+	// Inodes that nothing refers to were already reported by check_references().
+	for (uint w = 0; w < (ninodes + 63) / 64 && !truncated; w++) {
+		uint64_t unreached = in_use[w] & ~visited[w];
+		while (unreached != 0 && !truncated) {
+			uint inum = w * 64 + __builtin_ctzll(unreached);
+			if (count[inum] != 0) {
+				report(CHECK_UNREACHABLE, inum, NONE, NONE);
 			}
+			// Clear the lowest set bit.
+			unreached &= unreached - 1;
+		}
+	}
+	free(stack);
+}
+
+/**
+ * Resolve path from the root, one probe of a directory's index of names per
+ * component, and print the inode it names. Return 0 on success. Return -1 if
+ * there is no such path.
+ */
+int resolve_path(const char* path) {
+	uint inum = ROOTINO;
+	const char* p = path;
+	while (*p != '\0') {
+		if (*p == '/') {
+			p++;
+			continue;
 		}
+		size_t length = strcspn(p, "/");
+		char name[DIRSIZ + 1];
+		if (length > DIRSIZ || inum >= ninodes || read_inodes(inum, 1)->type != T_DIR) {
+			return -1;
+		}
+		memcpy(name, p, length);
+		name[length] = '\0';
+		walk_directory(inum, inum, index_entries);
+		struct dirent* entry = dir_index_lookup(&names, name);
+		if (entry == NULL) {
+			return -1;
+		}
+		inum = entry->inum;
+		p += length;
 	}
+	if (inum >= ninodes) {
+		return -1;
+	}
+	printf("%s: inode %u type %d\n", path, inum, read_inodes(inum, 1)->type);
 	return 0;
 }
 
 /**
- * For in-use inodes, check if indirect address is only used once.
+ * Allocate a free data block, zero it and record it as used by a direct
+ * pointer. Return its address, or 0 if the image is full.
  */
-int indirect_once() {
-	for (uint i = 0; i < ninodes; i++) {
-		if (inode_table[i].type != 0) {
-			if (inode_table[i].addrs[NDIRECT] != 0) {
-				if (inode_table[i].addrs[NDIRECT] > 1) {
-					return -1;
+uint allocate_block() {
+	for (uint addr = data_blocks; addr < size; addr++) {
+		if (!test_bit(blocks_used, addr)) {
+			set_bit(blocks_used, addr);
+			set_bit(blocks_direct, addr);
+			memset(block_ptr(addr), 0, bsize);
+			return addr;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Add an entry called name referring to inode target to directory inum,
+ * growing the directory by one direct block if it is full. Return 0 on
+ * success. Return -1 if there is no room.
+ */
+int add_entry(uint inum, const char* name, uint target) {
+	struct dinode* dip = &inode_table[inum];
+	uint num = bsize / (sizeof(struct dirent));
+	for (uint n = 0; n < ndirect; n++) {
+		if (dip->addrs[n] == 0) {
+			uint addr = allocate_block();
+			if (addr == 0) {
+				return -1;
+			}
+			repaired("inode %u: addrs[%u] 0 -> %u", inum, n, addr);
+			dip->addrs[n] = addr;
+		}
+		struct dirent* directory_entry = block_ptr(dip->addrs[n]);
+		for (uint k = 0; k < num; k++) {
+			if (directory_entry[k].inum == 0) {
+				repaired("inode %u: add entry \"%s\" -> inode %u", inum, name, target);
+				directory_entry[k].inum = target;
+				// Names fill the whole field and are not always NUL-terminated.
+				memset(directory_entry[k].name, 0, DIRSIZ);
+				memcpy(directory_entry[k].name, name, strnlen(name, DIRSIZ));
+				uint end = (n * num + k + 1) * sizeof(struct dirent);
+				if (dip->size < end) {
+					dip->size = end;
 				}
-				uint* addr = (uint*)(img_ptr + BSIZE * inode_table[i].addrs[NDIRECT]);
-				for (uint j = 0; j < NINDIRECT; j++) {
-					if (addr[j] != 0 && blocks_used[addr[j] > 1]) {
-						return -1;
-					}
+				if (count[target] != COUNT_MAX) {
+					count[target]++;
 				}
+				return 0;
 			}
 		}
 	}
-	return 0;
+	return -1;
 }
 
 /**
- * For each block marked in-use in bitmap, check if it is actually in-use in
- * an inode or indirect block somewhere.
+ * Return the inode number of /lost+found, creating the directory if it does
+ * not exist. Return 0 if it cannot be created.
  */
-int marked_used() {
-	// Start from data blocks.
-	for (uint addr = data_blocks; addr < size; addr++) {
-		if (((bitmap[addr / 8] >> (addr % 8)) & 1) && blocks_used[addr] == 0) {
+uint lost_found() {
+	uint inum = xv6_lookup(&fs, "/lost+found");
+	if (inum != 0) {
+		return inode_table[inum].type == T_DIR ? inum : 0;
+	}
+	// Take the first inode that is neither in use nor referred to.
+	for (inum = ROOTINO + 1; inum < ninodes; inum++) {
+		if (inode_table[inum].type == 0 && count[inum] == 0) {
+			break;
+		}
+	}
+	if (inum == ninodes) {
+		return 0;
+	}
+	uint addr = allocate_block();
+	if (addr == 0) {
+		return 0;
+	}
+	repaired("inode %u: create lost+found in block %u", inum, addr);
+	struct dinode* dip = &inode_table[inum];
+	memset(dip, 0, sizeof(struct dinode));
+	dip->type = T_DIR;
+	dip->nlink = 1;
+	dip->size = 2 * sizeof(struct dirent);
+	dip->addrs[0] = addr;
+	struct dirent* directory_entry = block_ptr(addr);
+	directory_entry[0].inum = inum;
+	strcpy(directory_entry[0].name, ".");
+	directory_entry[1].inum = ROOTINO;
+	strcpy(directory_entry[1].name, "..");
+	if (add_entry(ROOTINO, "lost+found", inum) == -1) {
+		return 0;
+	}
+	return inum;
+}
+
+/**
+ * Link every in-use inode that no directory refers to into /lost+found under
+ * its inode number. Orphaned directories get their ".." entry updated.
+ * Return 0 if every orphan was linked. Return -1 otherwise.
+ */
+int reattach_orphans() {
+	uint lf = 0;
+	for (uint i = ROOTINO + 1; i < ninodes; i++) {
+		if (inode_table[i].type == 0 || count[i] != 0 || inode_type(&inode_table[i]) == -1) {
+			continue;
+		}
+		if (lf == 0 && (lf = lost_found()) == 0) {
+			return -1;
+		}
+		char name[DIRSIZ + 1];
+		snprintf(name, sizeof(name), "#%u", i);
+		if (add_entry(lf, name, i) == -1) {
 			return -1;
 		}
+		if (inode_table[i].type != T_DIR || !valid_addr(inode_table[i].addrs[0])) {
+			continue;
+		}
+		uint entry;
+		struct dirent* directory_entry = block_ptr(inode_table[i].addrs[0]);
+		if (directory_format(i, directory_entry, &entry) == 0) {
+			repaired("inode %u: \"..\" %u -> %u", i, directory_entry[1].inum, lf);
+			directory_entry[1].inum = lf;
+		}
 	}
 	return 0;
 }
 
 /**
- *
+ * Set the link count of every regular file to the number of directory entries
+ * referring to it.
  */
+void fix_nlink() {
+	for (uint i = 0; i < ninodes; i++) {
+		struct dinode* dip = &inode_table[i];
+		if (dip->type == T_FILE && count[i] != dip->nlink && count[i] <= SHRT_MAX) {
+			repaired("inode %u: nlink %d -> %u", i, dip->nlink, count[i]);
+			dip->nlink = count[i];
+		}
+	}
+}
 
-int main(int argc, char* argv[]) {
-	if (argc != 2) {
-		fprintf(stderr, "Usage: xv6_fsck <file_system_image>.\n");
-		exit(1);
+/**
+ * Regenerate the bitmap: metadata blocks and the data blocks found in use are
+ * marked in use, every other block free. Changes are printed as block ranges.
+ */
+void rebuild_bitmap() {
+	uint addr = 0;
+	while (addr < size) {
+		// Skip whole words that are already correct.
+		uint w = addr / 64;
+		uint64_t wanted = block_mask(w, 0, data_blocks) | (blocks_used[w] & data_mask(w));
+		if (addr % 64 == 0 && ((bitmap_word(w) ^ wanted) & block_mask(w, 0, size)) == 0) {
+			addr += 64;
+			continue;
+		}
+		int used = addr < data_blocks || test_bit(blocks_used, addr);
+		if (bitmap_used(addr) == used) {
+			addr++;
+			continue;
+		}
+		// Extend the run of blocks that change the same way.
+		uint end = addr;
+		while (end < size && bitmap_used(end) != used &&
+			(end < data_blocks || test_bit(blocks_used, end)) == used) {
+			bitmap[end / 8] ^= 1 << (end % 8);
+			end++;
+		}
+		repaired("bitmap: blocks %u-%u %s", addr, end - 1, used ? "free -> used" : "used -> free");
+		addr = end;
 	}
-	// Open the file read-only and return a file descriptor.
-	int fd = open(argv[1], O_RDONLY);
-	// open() returns -1 if an error occured.
-	if (fd < 0) {
-		fprintf(stderr, "image not found.\n");
-		exit(1);
+}
+
+/**
+ * Fix the errors found by the checks that can be repaired and clear them from
+ * failed. Bad addresses and entries referring to free inodes have already
+ * been cleared during the pass over the inode table. A dry run writes nothing,
+ * so the errors it would fix stay in failed.
+ */
+void repair_image() {
+	uint found = failed;
+	failed &= ~((1 << CHECK_DIRECT_ADDR) | (1 << CHECK_INDIRECT_ADDR) |
+		(1 << CHECK_INODE_REFERRED_FREE));
+	// Reference counts can only be trusted if the directory tree is sound.
+	if (!(failed & STRUCTURAL)) {
+		failed &= ~(1 << CHECK_PARENT);
+		if (reattach_orphans() == 0) {
+			failed &= ~(1 << CHECK_INODE_UNREFERENCED);
+		}
+		fix_nlink();
+		failed &= ~(1 << CHECK_REFERENCE_COUNT);
 	}
-	struct stat buf;
-	// Retrieve information about the file.
-	if (fstat(fd, &buf) == -1) {
-		fprintf(stderr, "fstat() failed.\n");
-		exit(1);
+	rebuild_bitmap();
+	failed &= ~((1 << CHECK_ADDRESS_BITMAP) | (1 << CHECK_MARKED_USED));
+	if (dry_run) {
+		failed = found;
 	}
-	// Map the file system image into memory.
-	img_ptr = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	sb = (struct superblock*)(img_ptr + BSIZE);
-	inode_table = (struct dinode*)(img_ptr + BSIZE * 2);
-	// 1 byte (8 bits).
-	bitmap = (uchar*)(img_ptr + BSIZE * ((sb->ninodes / 8) + 3));
-	// The first data block is the 29th (zero-based numbering) block of the
-	// file system image.
-	data_blocks = (sb->ninodes / 8) + 4;
-	size = sb->size;
-	nblocks = sb->nblocks;
-	ninodes = sb->ninodes;
-	blocks_used = malloc(sizeof(int) * size);
+}
 
-	if (inode_type() == -1) {
-		fprintf(stderr, "ERROR: bad inode.\n");
-		exit(1);
+/**
+ * Print the error of the first failed check and exit, if any check failed.
+ */
+void exit_on_error() {
+	for (int c = 0; c < NCHECKS; c++) {
+		if (failed & (1 << c)) {
+			fprintf(stderr, "%s\n", check_errors[c]);
+			exit(1);
+		}
 	}
+}
 
-	// Check the directory format first, then perform the root check.
-	if (directory_format() == -1) {
-		fprintf(stderr, "ERROR: directory not properly formatted.\n");
-		exit(1);
+/**
+ * Order violations by check, then inode, block and entry.
+ */
+int compare_violations(const void* a, const void* b) {
+	const struct violation* x = a;
+	const struct violation* y = b;
+	if (x->check != y->check) {
+		return x->check < y->check ? -1 : 1;
+	}
+	if (x->inum != y->inum) {
+		return x->inum < y->inum ? -1 : 1;
+	}
+	if (x->block != y->block) {
+		return x->block < y->block ? -1 : 1;
 	}
+	if (x->entry != y->entry) {
+		return x->entry < y->entry ? -1 : 1;
+	}
+	return 0;
+}
 
-	if (root_check() == -1) {
-		fprintf(stderr, "ERROR: root directory does not exist.\n");
-		exit(1);
+/**
+ * Print a field of a violation as JSON, using null if it does not apply.
+ */
+void print_json_field(const char* name, uint value) {
+	if (value == NONE) {
+		printf(", \"%s\": null", name);
 	}
+	else {
+		printf(", \"%s\": %u", name, value);
+	}
+}
 
-	if (direct_addr() == -1) {
-		fprintf(stderr, "ERROR: bad direct address in inode.\n");
-		exit(1);
+/**
+ * Print every collected violation to stdout, as text or JSON.
+ */
+void print_violations() {
+	qsort(violations, nviolations, sizeof(struct violation), compare_violations);
+	if (json) {
+		printf("{\"errors\": [");
+		for (uint i = 0; i < nviolations; i++) {
+			struct violation* v = &violations[i];
+			printf("%s\n  {\"check\": %u, \"name\": \"%s\"", i == 0 ? "" : ",",
+				v->check + 1, check_names[v->check]);
+			print_json_field("inode", v->inum);
+			print_json_field("block", v->block);
+			print_json_field("entry", v->entry);
+			if (v->last != NONE) {
+				print_json_field("last_block", v->last);
+			}
+			printf("}");
+		}
+		printf("%s], \"count\": %u, \"truncated\": %s}\n",
+			nviolations == 0 ? "" : "\n", nviolations, truncated ? "true" : "false");
+		return;
+	}
+	for (uint i = 0; i < nviolations; i++) {
+		struct violation* v = &violations[i];
+		printf("%s check=%u(%s)", check_errors[v->check], v->check + 1,
+			check_names[v->check]);
+		if (v->inum != NONE) {
+			printf(" inode=%u", v->inum);
+		}
+		if (v->last != NONE) {
+			printf(" blocks=%u-%u", v->block, v->last);
+		}
+		else if (v->block != NONE) {
+			printf(" block=%u", v->block);
+		}
+		if (v->entry != NONE) {
+			printf(" entry=%u", v->entry);
+		}
+		printf("\n");
 	}
+	if (truncated) {
+		printf("Stopped after %u errors.\n", nviolations);
+	}
+}
 
-	if (indirect_addr() == -1) {
-		fprintf(stderr, "ERROR: bad indirect address in inode.\n");
+/**
+ * Take the geometry of the image from its reader, which found the block size
+ * and checked the superblock when it opened the image.
+ */
+void read_geometry() {
+	bsize = fs.bsize;
+	super = fs.sb;
+	sb = &super;
+	ndirect = fs.ndirect;
+	nindirect = fs.nindirect;
+	size = sb->size;
+	nblocks = sb->nblocks;
+	ninodes = sb->ninodes;
+	data_blocks = fs.data_start;
+}
+
+/**
+ * Read the bitmap of a streamed image into memory.
+ */
+void read_bitmap() {
+	// Read whole words of the bitmap, starting from an aligned offset.
+	uint64_t offset = (uint64_t)bsize * fs.bitmap_start;
+	uint64_t start = offset / IMAGE_ALIGN * IMAGE_ALIGN;
+	uint64_t end = offset + (uint64_t)(size + 63) / 64 * 8;
+	end = (end + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+	uchar* buf = allocated(image_buffer(end - start));
+	if (image_read(&fs.img, buf, start, end - start) == -1) {
 		exit(1);
 	}
+	bitmap = buf + (offset - start);
+}
 
-	// Count the number of times that each address is used.
-	address_count();
+void usage(void) {
+	fprintf(stderr, "Usage: xv6_fsck [--all] [--json] [--max-errors N] "
+		"[--repair [--dry-run]] [--stream [--direct] [--memory MB]] "
+		"[--block-size N] [--double-indirect] [--state FILE] [--path PATH] [--stats] "
+		"[--fragmentation] "
+		"<file_system_image>.\n");
+	exit(1);
+}
 
-	if (direct_once() == -1) {
-		fprintf(stderr, "ERROR: direct address used more than once.\n");
-		exit(1);
+int main(int argc, char* argv[]) {
+	struct option options[] = {
+		{"all", no_argument, NULL, 'a'},
+		{"json", no_argument, NULL, 'j'},
+		{"max-errors", required_argument, NULL, 'm'},
+		{"repair", no_argument, NULL, 'r'},
+		{"dry-run", no_argument, NULL, 'n'},
+		{"stream", no_argument, NULL, 's'},
+		{"direct", no_argument, NULL, 'd'},
+		{"memory", required_argument, NULL, 'M'},
+		{"block-size", required_argument, NULL, 'b'},
+		{"double-indirect", no_argument, NULL, 'D'},
+		{"state", required_argument, NULL, 'S'},
+		{"path", required_argument, NULL, 'p'},
+		{"stats", no_argument, NULL, 't'},
+		{"fragmentation", no_argument, NULL, 'f'},
+		{NULL, 0, NULL, 0}
+	};
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	int c;
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "ajm:rnsdM:b:DS:p:tf", options, NULL)) != -1) {
+		switch (c) {
+		case 'a':
+			report_all = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'm':
+			max_errors = strtoul(optarg, NULL, 10);
+			if (max_errors == 0) {
+				usage();
+			}
+			break;
+		case 'r':
+			repair = 1;
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		case 's':
+			stream = 1;
+			break;
+		case 'd':
+			direct_io = 1;
+			break;
+		case 'M':
+			memory = (size_t)strtoul(optarg, NULL, 10) << 20;
+			if (memory == 0) {
+				usage();
+			}
+			break;
+		case 'b':
+			bsize = strtoul(optarg, NULL, 10);
+			// The block size must be a power of two from 512 to 64 KB.
+			if (bsize < 512 || bsize > 65536 || (bsize & (bsize - 1)) != 0) {
+				usage();
+			}
+			break;
+		case 'D':
+			// The last address of each inode is a double-indirect block.
+			dindirect = 1;
+			break;
+		case 'S':
+			state_path = optarg;
+			break;
+		case 'p':
+			path = optarg;
+			break;
+		case 't':
+			stats = 1;
+			break;
+		case 'f':
+			fragmentation = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	// Print the statistics however the check ends.
+	if (stats) {
+		atexit(print_stats);
+	}
+	// A dry run computes the repairs in a private copy of the image.
+	if (dry_run) {
+		repair = 1;
+	}
+	// JSON is only printed for the collected violations.
+	if (json) {
+		report_all = 1;
 	}
-	/*
-	   if (indirect_once() == -1) {
-	   fprintf(stderr, "ERROR: indirect address used more than once.\n");
-	   exit(1);
-	   }
-	 */
-	if (address_bitmap() == -1) {
-		fprintf(stderr, "ERROR: address used by inode but marked free in bitmap.\n");
+	// Repairs and the state need the image mapped, and a repaired image is
+	// checked again before its state is saved. Files are only laid out by a
+	// full pass over the inode table.
+	if (optind != argc - 1 || (repair && (stream || direct_io)) ||
+		(state_path != NULL && (repair || stream || direct_io || fragmentation))) {
+		usage();
+	}
+	struct stat buf;
+	// Retrieve information about the file.
+	if (stat(argv[optind], &buf) == -1) {
+		fprintf(stderr, "image not found.\n");
 		exit(1);
 	}
-
-	if (marked_used() == -1) {
-		fprintf(stderr, "ERROR: bitmap marks block in use but it is not in use.\n");
+	// Block devices are streamed: fstat() does not report their size and
+	// random page faults on them are slow.
+	if (S_ISBLK(buf.st_mode) && !repair && state_path == NULL) {
+		stream = 1;
+	}
+	int flags = dindirect ? XV6_DINDIRECT : 0;
+	if (repair) {
+		flags |= dry_run ? XV6_PRIVATE : XV6_WRITE;
+	}
+	if (stream || direct_io) {
+		flags |= direct_io ? XV6_DIRECT : XV6_STREAM;
+	}
+	// Open the file system image and map it into memory unless streaming.
+	if (xv6_open(&fs, argv[optind], bsize, flags) == -1) {
 		exit(1);
 	}
-
-	uint* count = malloc(sizeof(uint) * ninodes);
-	// Number of directory entries can be contained in a data block.
-	uint num = BSIZE / (sizeof(struct dirent));
-	// Get the number of times that each inode is referred to.
+	img_ptr = fs.img.map;
+	read_geometry();
+	if (img_ptr != NULL) {
+		inode_table = block_ptr(2);
+		// 1 byte (8 bits).
+		bitmap = block_ptr(fs.bitmap_start);
+	}
+	else {
+		read_bitmap();
+	}
+	// Two bits per block and a 16-bit reference count per inode.
+	blocks_used = allocated(calloc((size + 63) / 64, sizeof(uint64_t)));
+	blocks_direct = allocated(calloc((size + 63) / 64, sizeof(uint64_t)));
+	count = allocated(calloc(ninodes, sizeof(ushort)));
+	// One bit per inode for the tree walk.
+	in_use = allocated(calloc((ninodes + 63) / 64, sizeof(uint64_t)));
+	directories = allocated(calloc((ninodes + 63) / 64, sizeof(uint64_t)));
+	visited = allocated(calloc((ninodes + 63) / 64, sizeof(uint64_t)));
+	on_path = allocated(calloc((ninodes + 63) / 64, sizeof(uint64_t)));
 	// The number of references to the root inode should be 1.
-	count[1] = 1;
-	for (uint i = 0; i < ninodes; i++) {
-		if (inode_table[i].type == 1) {
-			for (uint j = 0; j < NDIRECT; j++) {
-				if (inode_table[i].addrs[j] != 0) {
-					uint addr = inode_table[i].addrs[j];
-					struct dirent* directory_entry = (struct dirent*)(img_ptr + BSIZE * addr);
-					// Skip the first two entries "." and "..".
-					int start = 0;
-					if (j == 0) {
-						start = 2;
-					}
-					for (int k = start; k < num; k++) {
-						if (directory_entry[k].inum != 0) {
-							count[directory_entry[k].inum]++;
-						}
-					}
-				}
-			}
-			if (inode_table[i].addrs[NDIRECT] != 0) {
-				uint* addr = (uint*)(img_ptr + BSIZE * inode_table[i].addrs[NDIRECT]);
-				for (uint j = 0; j < NINDIRECT; j++) {
-					if (addr[j] != 0) {
-						struct dirent* directory_entry = (struct dirent*)(img_ptr + BSIZE * addr[j]);
-						for (uint k = 0; k < num; k++) {
-							if (directory_entry[k].inum != 0) {
-								count[directory_entry[k].inum]++;
-							}
-						}
-					}
-				}
-			}
-		}
+	count[ROOTINO] = 1;
+	if (fragmentation) {
+		extents = allocated(calloc(ninodes, sizeof(uint)));
 	}
 
-	// Check for condition 9 ~ 12.
-	for (uint i = 0; i < ninodes; i++) {
-		// Every inode in use must be referenced at least once.
-		if (inode_table[i].type != 0 && count[i] == 0) {
-			fprintf(stderr, "ERROR: inode marked use but not found in a directory.\n");
-			exit(1);
+	// Split the memory budget between the inode chunk, the block window and
+	// the queue of pending blocks.
+	chunk_inodes = memory / 4 / sizeof(struct dinode);
+	window_bytes = memory / 4 < 2 * IMAGE_ALIGN ? 2 * IMAGE_ALIGN : memory / 4;
+	max_pending = memory / 4 / sizeof(struct pending);
+	if (img_ptr == NULL) {
+		inode_buffer = allocated(image_buffer((size_t)chunk_inodes * sizeof(struct dinode) + 2 * IMAGE_ALIGN));
+		window = allocated(image_buffer(window_bytes));
+		for (int level = 0; level < 3; level++) {
+			walk_buffers[level] = allocated(image_buffer(run_bytes(0, 1) + IMAGE_ALIGN));
 		}
-		// Inode is referred to some other directories, but it is not in use.
-		if (inode_table[i].type == 0 && count[i] != 0) {
-			fprintf(stderr, "ERROR: inode referred to in directory but marked free.\n");
-			exit(1);
-		}
-		// Check if a directory has more than one link.
-		if (inode_table[i].type == 1 && count[i] > 1) {
-			fprintf(stderr, "ERROR: directory appears more than once in file system.\n");
-			exit(1);
-		}
-		// Check if nlinks is consistent for regular file.
-		if (inode_table[i].type == 2 && count[i] != inode_table[i].nlink) {
-			fprintf(stderr, "ERROR: bad reference count for file.\n");
+	}
+
+	if (state_path == NULL || check_changed() == -1) {
+		check_inodes();
+	}
+	else {
+		incremental = 1;
+	}
+	if (rescan_bitmap) {
+		bitmap_check();
+	}
+	// Reported before the first error stops the check.
+	if (fragmentation) {
+		join_segments();
+		print_fragmentation();
+	}
+	if (!report_all && !repair) {
+		exit_on_error();
+	}
+	if (rescan_references) {
+		check_references();
+	}
+	if (!report_all && !repair) {
+		exit_on_error();
+	}
+	if (rescan_tree) {
+		walk_tree();
+	}
+	if (report_all) {
+		print_violations();
+		free(violations);
+	}
+	if (repair) {
+		repair_image();
+		if (image_sync(&fs.img) == -1) {
 			exit(1);
 		}
 	}
+	if (state_path != NULL && !failed) {
+		save_state();
+	}
+	if (!report_all) {
+		exit_on_error();
+	}
+	if (path != NULL && resolve_path(path) == -1) {
+		fprintf(stderr, "ERROR: path not found.\n");
+		exit(1);
+	}
 
+	print_stats();
+	dir_index_free(&names);
+	state_free(&state);
 	free(blocks_used);
+	free(marked_free);
+	free(blocks_direct);
 	free(count);
-
-	// Remove the mapped system file image from the address
-	// space of the process.
-	if (munmap(img_ptr, buf.st_size) == -1) {
-		fprintf(stderr, "munmap() failed.\n");
-		exit(1);
+	free(in_use);
+	free(directories);
+	free(visited);
+	free(on_path);
+	free(extents);
+	free(pending);
+	free(inode_buffer);
+	free(window);
+	for (int level = 0; level < 3; level++) {
+		free(walk_buffers[level]);
 	}
-
-	// Close the file descriptor, so that it no longer refers to any file
-	// and may be reused.
-	if (close(fd) == -1) {
-		fprintf(stderr, "close() failed.\n");
+	if (xv6_close(&fs) == -1) {
 		exit(1);
 	}
-	return 0;
-}
\ No newline at end of file
+	return failed ? 1 : 0;
+}
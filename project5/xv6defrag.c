@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <getopt.h>
+#include <libgen.h>
+#include "fs.h"
+#include "stat.h"
+#include "types.h"
+#include "xv6.h"
+
+// A list of inodes.
+struct list {
+	uint* inums;
+	uint n;
+	uint capacity;
+};
+
+struct xv6 fs;                     /* Reader of the image being compacted. */
+uint bsize = 0;                    /* Block size in bytes, detected if 0. */
+int flags = 0;                     /* XV6_* flags for the reader. */
+size_t batch = 4 << 20;            /* Bytes read and written at a time. */
+uint size;                         /* Size of the image in blocks. */
+uint data_blocks;                  /* First data block. */
+uint bitmap_block;                 /* First block of the bitmap. */
+uint* remap;                       /* New address of each block in use, 0 if free. */
+uint* source;                      /* Old address of each new block. */
+uint64_t* holds_addresses;         /* Bit b is set if old block b is an indirect block. */
+uint64_t* seen;                    /* Bit i is set if inode i was laid out. */
+uint* level1;                      /* Addresses in the indirect block being laid out. */
+uint* level2;                      /* Addresses in the double-indirect block being laid out. */
+uint next_block;                   /* Next new address to hand out. */
+uint64_t moved;                    /* Blocks whose address changes. */
+uint64_t runs_before;              /* Runs of adjacent blocks in the old layout. */
+
+/**
+ * Return p, memory just allocated, or exit with a message if the allocation
+ * failed.
+ */
+void* allocated(void* p) {
+	if (p == NULL) {
+		fprintf(stderr, "malloc() failed.\n");
+		exit(1);
+	}
+	return p;
+}
+
+/**
+ * Return 1 if bit b of set is set. Return 0 otherwise.
+ */
+int test_bit(uint64_t* set, uint b) {
+	return (set[b / 64] >> (b % 64)) & 1;
+}
+
+/**
+ * Set bit b of set.
+ */
+void set_bit(uint64_t* set, uint b) {
+	set[b / 64] |= 1ULL << (b % 64);
+}
+
+/**
+ * Read count blocks from block addr of the image into buf. Return 0 on
+ * success. Return -1 if there is an error.
+ */
+int read_blocks(uint addr, uint count, void* buf) {
+	if (fs.img.map != NULL) {
+		memcpy(buf, fs.img.map + (uint64_t)bsize * addr, (size_t)bsize * count);
+		return 0;
+	}
+	return image_read(&fs.img, buf, (uint64_t)bsize * addr, (size_t)bsize * count);
+}
+
+/**
+ * Give block addr the next new address. The image must be sound: a block out
+ * of the data area or used twice cannot be moved, so the compaction stops.
+ */
+void place_block(uint addr, int indirect) {
+	if (addr < data_blocks || addr >= size || remap[addr] != 0) {
+		fprintf(stderr, "ERROR: block %u is out of range or used more than once; "
+			"run xv6_fsck first.\n", addr);
+		exit(1);
+	}
+	if (next_block == data_blocks || source[next_block - 1] + 1 != addr) {
+		runs_before++;
+	}
+	remap[addr] = next_block;
+	source[next_block] = addr;
+	moved += addr != next_block;
+	next_block++;
+	if (indirect) {
+		set_bit(holds_addresses, addr);
+	}
+}
+
+/**
+ * Read the addresses in indirect block addr into buf.
+ */
+void read_addresses(uint addr, uint* buf) {
+	if (read_blocks(addr, 1, buf) == -1) {
+		exit(1);
+	}
+}
+
+/**
+ * Lay out the blocks of inode dip in the order a sequential read visits
+ * them: the direct blocks, then each indirect block followed by the blocks
+ * it points at, the double-indirect block before the first of its indirect
+ * blocks. That is the order xv6_fsck --fragmentation counts as one extent.
+ */
+void place_inode(struct dinode* dip) {
+	uint nindirect = fs.nindirect;
+	for (uint j = 0; j < fs.ndirect; j++) {
+		if (dip->addrs[j] != 0) {
+			place_block(dip->addrs[j], 0);
+		}
+	}
+	uint indirect = dip->addrs[fs.ndirect];
+	if (indirect != 0) {
+		place_block(indirect, 1);
+		read_addresses(indirect, level1);
+		for (uint k = 0; k < nindirect; k++) {
+			if (level1[k] != 0) {
+				place_block(level1[k], 0);
+			}
+		}
+	}
+	uint dind = fs.dindirect ? dip->addrs[fs.ndirect + 1] : 0;
+	if (dind != 0) {
+		place_block(dind, 1);
+		read_addresses(dind, level2);
+		for (uint i = 0; i < nindirect; i++) {
+			if (level2[i] == 0) {
+				continue;
+			}
+			place_block(level2[i], 1);
+			read_addresses(level2[i], level1);
+			for (uint k = 0; k < nindirect; k++) {
+				if (level1[k] != 0) {
+					place_block(level1[k], 0);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Add inum to list.
+ */
+void add_inum(struct list* list, uint inum) {
+	if (list->n == list->capacity) {
+		list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+		list->inums = allocated(realloc(list->inums, sizeof(uint) * list->capacity));
+	}
+	list->inums[list->n++] = inum;
+}
+
+/**
+ * Collect the entries of a directory other than "." and "..".
+ */
+int collect_entry(void* arg, const struct dirent* entry) {
+	if (strncmp(entry->name, ".", DIRSIZ) != 0 && strncmp(entry->name, "..", DIRSIZ) != 0 &&
+		entry->inum < fs.sb.ninodes) {
+		add_inum(arg, entry->inum);
+	}
+	return 0;
+}
+
+/**
+ * Lay out directory dir, then the files in it in the order of its entries,
+ * then its subdirectories the same way, so that a directory and its files
+ * end up next to each other. Each inode is laid out once, at its first link.
+ */
+void place_directory(uint dir) {
+	struct dinode dip;
+	set_bit(seen, dir);
+	xv6_inode(&fs, dir, &dip);
+	place_inode(&dip);
+	struct list entries = {NULL, 0, 0};
+	xv6_readdir(&fs, dir, collect_entry, &entries);
+	for (int pass = 0; pass < 2; pass++) {
+		for (uint i = 0; i < entries.n; i++) {
+			uint inum = entries.inums[i];
+			if (test_bit(seen, inum) || xv6_inode(&fs, inum, &dip) == -1 || dip.type == 0 ||
+				(dip.type == T_DIR) != pass) {
+				continue;
+			}
+			if (pass == 0) {
+				set_bit(seen, inum);
+				place_inode(&dip);
+			}
+			else {
+				place_directory(inum);
+			}
+		}
+	}
+	free(entries.inums);
+}
+
+/**
+ * Lay out every inode in use: the tree from the root, then the inodes no
+ * directory refers to, so that their blocks are kept.
+ */
+void place_all() {
+	next_block = data_blocks;
+	place_directory(ROOTINO);
+	for (uint inum = ROOTINO + 1; inum < fs.sb.ninodes; inum++) {
+		struct dinode dip;
+		if (!test_bit(seen, inum) && xv6_inode(&fs, inum, &dip) == 0 && dip.type != 0) {
+			set_bit(seen, inum);
+			place_inode(&dip);
+		}
+	}
+}
+
+/**
+ * Replace the nonzero addresses in addrs with their new ones.
+ */
+void remap_addresses(uint* addrs, uint n) {
+	for (uint i = 0; i < n; i++) {
+		if (addrs[i] != 0) {
+			addrs[i] = remap[addrs[i]];
+		}
+	}
+}
+
+/**
+ * Fill new block addr, whose contents are in data, with the new addresses or
+ * bitmap it holds.
+ */
+void rewrite_block(uint addr, uchar* data) {
+	if (addr >= 2 && addr < bitmap_block) {
+		struct dinode* dip = (struct dinode*)data;
+		uint first = (addr - 2) * IPB_OF(bsize);
+		for (uint i = 0; i < IPB_OF(bsize) && first + i < fs.sb.ninodes; i++) {
+			if (dip[i].type != 0) {
+				remap_addresses(dip[i].addrs, fs.ndirect + 1 + fs.dindirect);
+			}
+		}
+	}
+	else if (addr >= bitmap_block && addr < data_blocks) {
+		// The blocks below next_block are exactly the ones in use.
+		uint64_t first = (uint64_t)(addr - bitmap_block) * BPB_OF(bsize);
+		memset(data, 0, bsize);
+		for (uint64_t b = first; b < first + BPB_OF(bsize) && b < next_block; b++) {
+			data[(b - first) / 8] |= 1 << (b % 8);
+		}
+	}
+	else if (addr >= data_blocks && test_bit(holds_addresses, source[addr])) {
+		remap_addresses((uint*)data, fs.nindirect);
+	}
+}
+
+/**
+ * Return the old address of new block addr.
+ */
+uint old_address(uint addr) {
+	return addr < data_blocks ? addr : source[addr];
+}
+
+/**
+ * Write the compacted image to descriptor fd, batch bytes at a time. Each
+ * batch is read in runs of blocks that stay adjacent in the old image.
+ * Return 0 on success. Return -1 if there is an error.
+ */
+int write_image(int fd) {
+	uint per_batch = batch / bsize < 1 ? 1 : batch / bsize;
+	uchar* buf = malloc((size_t)per_batch * bsize);
+	if (buf == NULL) {
+		return -1;
+	}
+	for (uint start = 0; start < next_block; start += per_batch) {
+		uint end = start + per_batch < next_block ? start + per_batch : next_block;
+		for (uint b = start; b < end;) {
+			uint from = old_address(b);
+			uint n = 1;
+			while (b + n < end && old_address(b + n) == from + n) {
+				n++;
+			}
+			if (read_blocks(from, n, buf + (size_t)(b - start) * bsize) == -1) {
+				free(buf);
+				return -1;
+			}
+			b += n;
+		}
+		for (uint b = start; b < end; b++) {
+			rewrite_block(b, buf + (size_t)(b - start) * bsize);
+		}
+		size_t length = (size_t)(end - start) * bsize;
+		for (size_t done = 0; done < length;) {
+			ssize_t n = write(fd, buf + done, length - done);
+			if (n < 0) {
+				free(buf);
+				return -1;
+			}
+			done += n;
+		}
+	}
+	free(buf);
+	// The free blocks read as zero.
+	return ftruncate(fd, (off_t)bsize * size);
+}
+
+/**
+ * Write the compacted image next to path and switch it into place once it
+ * is on disk, so that a crash leaves either the old image or the new one.
+ * Return 0 on success. Return -1 if there is an error.
+ */
+int save_image(const char* path) {
+	size_t length = strlen(path);
+	char* temporary = malloc(length + 8);
+	if (temporary == NULL) {
+		return -1;
+	}
+	snprintf(temporary, length + 8, "%s.defrag", path);
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(temporary);
+		return -1;
+	}
+	int error = write_image(fd) == -1 || fsync(fd) == -1;
+	if (close(fd) == -1) {
+		error = 1;
+	}
+	if (error || rename(temporary, path) == -1) {
+		unlink(temporary);
+		free(temporary);
+		return -1;
+	}
+	// Make the rename itself durable.
+	char* copy = strdup(path);
+	int dir = copy != NULL ? open(dirname(copy), O_RDONLY | O_DIRECTORY) : -1;
+	if (dir >= 0) {
+		fsync(dir);
+		close(dir);
+	}
+	free(copy);
+	free(temporary);
+	return 0;
+}
+
+void usage(void) {
+	fprintf(stderr, "Usage: xv6defrag [--block-size N] [--double-indirect] [--stream] "
+		"[--batch MB] [--dry-run] <file_system_image> [<output>].\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	struct option options[] = {
+		{"block-size", required_argument, NULL, 'b'},
+		{"double-indirect", no_argument, NULL, 'D'},
+		{"stream", no_argument, NULL, 's'},
+		{"batch", required_argument, NULL, 'B'},
+		{"dry-run", no_argument, NULL, 'n'},
+		{NULL, 0, NULL, 0}
+	};
+	int dry_run = 0;
+	int c;
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "b:DsB:n", options, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			bsize = strtoul(optarg, NULL, 10);
+			// The block size must be a power of two from 512 to 64 KB.
+			if (bsize < 512 || bsize > 65536 || (bsize & (bsize - 1)) != 0) {
+				usage();
+			}
+			break;
+		case 'D':
+			flags |= XV6_DINDIRECT;
+			break;
+		case 's':
+			flags |= XV6_STREAM;
+			break;
+		case 'B':
+			batch = (size_t)strtoul(optarg, NULL, 10) << 20;
+			if (batch == 0) {
+				usage();
+			}
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 1 && argc - optind != 2) {
+		usage();
+	}
+	char* image_path = argv[optind];
+	// Without an output the image is replaced.
+	char* output = argc - optind == 2 ? argv[optind + 1] : image_path;
+	if (xv6_open(&fs, image_path, bsize, flags) == -1) {
+		exit(1);
+	}
+	bsize = fs.bsize;
+	size = fs.sb.size;
+	bitmap_block = fs.bitmap_start;
+	data_blocks = fs.data_start;
+	remap = allocated(calloc(size, sizeof(uint)));
+	source = allocated(calloc(size, sizeof(uint)));
+	holds_addresses = allocated(calloc((size + 63) / 64, sizeof(uint64_t)));
+	seen = allocated(calloc((fs.sb.ninodes + 63) / 64, sizeof(uint64_t)));
+	// Scratch space for the indirect blocks of the inode being laid out.
+	level1 = allocated(malloc(bsize));
+	level2 = allocated(malloc(bsize));
+
+	place_all();
+	printf("%u data blocks in use in %llu runs, %llu moved\n", next_block - data_blocks,
+		(unsigned long long)runs_before, (unsigned long long)moved);
+	int status = 0;
+	if (!dry_run && save_image(output) == -1) {
+		fprintf(stderr, "cannot write %s.\n", output);
+		status = 1;
+	}
+
+	xv6_close(&fs);
+	free(remap);
+	free(source);
+	free(holds_addresses);
+	free(seen);
+	free(level1);
+	free(level2);
+	return status;
+}
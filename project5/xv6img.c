@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "fs.h"
+#include "stat.h"
+#include "types.h"
+#include "xv6.h"
+
+// Bytes copied at a time when a file is read out of the image.
+#define CHUNK (1 << 20)
+
+// A file to extract.
+struct job {
+	uint inum;   /* Inode of the file. */
+	char* path;  /* Where to write it. */
+};
+
+char* image_path;                  /* Path of the image. */
+uint bsize = 0;                    /* Block size in bytes, detected if 0. */
+int flags = 0;                     /* XV6_* flags for the readers. */
+int jobs = 4;                      /* Threads extracting files. */
+struct xv6 fs;                     /* Reader of the main thread. */
+struct job* files;                 /* Files to extract. */
+uint nfiles;                       /* Number of files to extract. */
+uint files_capacity;               /* Allocated files. */
+uint next_file;                    /* Next file for a thread to take. */
+int failed = 0;                    /* Some file could not be extracted. */
+uint64_t* seen;                    /* Bit i is set if directory i was extracted. */
+
+/**
+ * Print one entry of a directory listing.
+ */
+int list_entry(void* arg, const struct dirent* entry) {
+	(void)arg;
+	struct dinode dip;
+	char name[DIRSIZ + 1];
+	memcpy(name, entry->name, DIRSIZ);
+	name[DIRSIZ] = '\0';
+	if (xv6_inode(&fs, entry->inum, &dip) == -1) {
+		printf("%-14s %6u ?\n", name, entry->inum);
+		return 0;
+	}
+	printf("%-14s %6u %d %10u\n", name, entry->inum, dip.type, dip.size);
+	return 0;
+}
+
+/**
+ * Write file dip of reader r to descriptor fd. Return 0 on success. Return
+ * -1 if there is an error.
+ */
+int copy_file(struct xv6* r, struct dinode* dip, int fd, uchar* buf) {
+	for (uint64_t offset = 0; offset < dip->size;) {
+		ssize_t n = xv6_read(r, dip, buf, offset, CHUNK);
+		if (n <= 0) {
+			return -1;
+		}
+		for (ssize_t done = 0; done < n;) {
+			ssize_t written = write(fd, buf + done, n - done);
+			if (written < 0) {
+				return -1;
+			}
+			done += written;
+		}
+		offset += n;
+	}
+	return 0;
+}
+
+/**
+ * Extract inode inum of reader r to path. Return 0 on success. Return -1 if
+ * there is an error, with a message printed.
+ */
+int extract_file(struct xv6* r, uint inum, const char* path, uchar* buf) {
+	struct dinode dip;
+	int fd = -1;
+	if (xv6_inode(r, inum, &dip) == -1 ||
+		(fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+		copy_file(r, &dip, fd, buf) == -1) {
+		fprintf(stderr, "cannot extract %s.\n", path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+ * Extract files until none is left, with a reader of its own. Return NULL if
+ * every file was extracted, or non-NULL if some could not be; the threads
+ * leave failed to extract() to set after joining them.
+ */
+void* extract_worker(void* arg) {
+	(void)arg;
+	struct xv6 r;
+	uchar* buf = malloc(CHUNK);
+	if (buf == NULL || xv6_open(&r, image_path, bsize, flags) == -1) {
+		free(buf);
+		return &failed;
+	}
+	int error = 0;
+	for (;;) {
+		uint i = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED);
+		if (i >= nfiles) {
+			break;
+		}
+		if (extract_file(&r, files[i].inum, files[i].path, buf) == -1) {
+			error = 1;
+		}
+	}
+	xv6_close(&r);
+	free(buf);
+	return error ? &failed : NULL;
+}
+
+// A directory being extracted.
+struct target {
+	const char* path;  /* Where its entries go. */
+};
+
+void extract_directory(uint inum, const char* path);
+
+/**
+ * Create the directory of one entry or queue its file for extraction.
+ */
+int extract_entry(void* arg, const struct dirent* entry) {
+	struct target* t = arg;
+	char name[DIRSIZ + 1];
+	memcpy(name, entry->name, DIRSIZ);
+	name[DIRSIZ] = '\0';
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '/') != NULL) {
+		return 0;
+	}
+	struct dinode dip;
+	if (xv6_inode(&fs, entry->inum, &dip) == -1) {
+		return 0;
+	}
+	size_t length = strlen(t->path) + strlen(name) + 2;
+	char* path = malloc(length);
+	snprintf(path, length, "%s/%s", t->path, name);
+	if (dip.type == T_DIR) {
+		extract_directory(entry->inum, path);
+		free(path);
+		return 0;
+	}
+	if (dip.type != T_FILE) {
+		free(path);
+		return 0;
+	}
+	if (nfiles == files_capacity) {
+		files_capacity = files_capacity == 0 ? 1024 : files_capacity * 2;
+		files = realloc(files, sizeof(struct job) * files_capacity);
+	}
+	files[nfiles].inum = entry->inum;
+	files[nfiles].path = path;
+	nfiles++;
+	return 0;
+}
+
+/**
+ * Create path and everything below directory inum in it, queueing the files.
+ * Each directory is extracted once, so a damaged image with a cycle ends.
+ */
+void extract_directory(uint inum, const char* path) {
+	if ((seen[inum / 64] >> (inum % 64)) & 1) {
+		return;
+	}
+	seen[inum / 64] |= 1ULL << (inum % 64);
+	if (mkdir(path, 0755) == -1 && access(path, W_OK) == -1) {
+		fprintf(stderr, "cannot extract %s.\n", path);
+		failed = 1;
+		return;
+	}
+	struct target t = {path};
+	xv6_readdir(&fs, inum, extract_entry, &t);
+}
+
+/**
+ * Extract the file or directory at inode inum to dest, files in parallel.
+ */
+void extract(uint inum, const char* dest) {
+	struct dinode dip;
+	xv6_inode(&fs, inum, &dip);
+	if (dip.type != T_DIR) {
+		uchar* buf = malloc(CHUNK);
+		if (extract_file(&fs, inum, dest, buf) == -1) {
+			failed = 1;
+		}
+		free(buf);
+		return;
+	}
+	seen = calloc((fs.sb.ninodes + 63) / 64, sizeof(uint64_t));
+	extract_directory(inum, dest);
+	pthread_t* threads = malloc(sizeof(pthread_t) * jobs);
+	for (int i = 0; i < jobs; i++) {
+		pthread_create(&threads[i], NULL, extract_worker, NULL);
+	}
+	for (int i = 0; i < jobs; i++) {
+		void* result;
+		pthread_join(threads[i], &result);
+		if (result != NULL) {
+			failed = 1;
+		}
+	}
+	for (uint i = 0; i < nfiles; i++) {
+		free(files[i].path);
+	}
+	free(files);
+	free(threads);
+	free(seen);
+}
+
+void usage(void) {
+	fprintf(stderr, "Usage: xv6img [--block-size N] [--double-indirect] [--stream] [--jobs N] "
+		"<file_system_image> ls|cat|extract <path> [<destination>].\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	struct option options[] = {
+		{"block-size", required_argument, NULL, 'b'},
+		{"double-indirect", no_argument, NULL, 'D'},
+		{"stream", no_argument, NULL, 's'},
+		{"jobs", required_argument, NULL, 'j'},
+		{NULL, 0, NULL, 0}
+	};
+	int c;
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "b:Dsj:", options, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			bsize = strtoul(optarg, NULL, 10);
+			// The block size must be a power of two from 512 to 64 KB.
+			if (bsize < 512 || bsize > 65536 || (bsize & (bsize - 1)) != 0) {
+				usage();
+			}
+			break;
+		case 'D':
+			flags |= XV6_DINDIRECT;
+			break;
+		case 's':
+			flags |= XV6_STREAM;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				usage();
+			}
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind < 3) {
+		usage();
+	}
+	image_path = argv[optind];
+	char* command = argv[optind + 1];
+	char* path = argv[optind + 2];
+	int extracting = strcmp(command, "extract") == 0;
+	if (extracting ? argc - optind != 4 : argc - optind != 3) {
+		usage();
+	}
+	if (!extracting && strcmp(command, "ls") != 0 && strcmp(command, "cat") != 0) {
+		usage();
+	}
+	if (xv6_open(&fs, image_path, bsize, flags) == -1) {
+		exit(1);
+	}
+	bsize = fs.bsize;
+	uint inum = xv6_lookup(&fs, path);
+	struct dinode dip;
+	if (inum == 0 || xv6_inode(&fs, inum, &dip) == -1 || dip.type == 0) {
+		fprintf(stderr, "%s: not found.\n", path);
+		exit(1);
+	}
+	if (strcmp(command, "ls") == 0) {
+		if (dip.type == T_DIR) {
+			xv6_readdir(&fs, inum, list_entry, NULL);
+		}
+		else {
+			printf("%-14s %6u %d %10u\n", path, inum, dip.type, dip.size);
+		}
+	}
+	else if (strcmp(command, "cat") == 0) {
+		uchar* buf = malloc(CHUNK);
+		if (copy_file(&fs, &dip, STDOUT_FILENO, buf) == -1) {
+			fprintf(stderr, "cannot read %s.\n", path);
+			failed = 1;
+		}
+		free(buf);
+	}
+	else {
+		extract(inum, argv[optind + 3]);
+	}
+	xv6_close(&fs);
+	return failed ? 1 : 0;
+}